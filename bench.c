@@ -0,0 +1,775 @@
+/*
+    bench.c - loopback benchmarks for the test builds of the clients and servers
+    Copyright (C) 2026  agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/poll.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pty.h>
+
+#include "librsh.h"
+
+#define REPEAT 5
+#define LATENCY_RUNS 50
+#define SESSIONS 200
+#define PARALLEL 8
+#define CONCURRENT 2000
+#define WINDOW 64
+#define PASSWORD "bench"
+#define BULK (256 << 20)
+#define TTYBULK (16 << 20)
+#define TIMEOUT 600
+
+static char *argv0;
+static char *dir = "test";
+static pid_t daemons[5];
+static char rshport[16], rloginport[16], rexecport[16], tlsport[16];
+static char rshsock[108];
+
+static void usage(void) {
+	fprintf(stderr, "Usage: %s [-d directory] [-c previous-report]\n", argv0);
+}
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void stop_daemons(void) {
+	int i;
+
+	for(i = 0; i < 5; i++)
+		if(daemons[i] > 0)
+			kill(daemons[i], SIGTERM);
+
+	if(*rshsock)
+		unlink(rshsock);
+}
+
+static void timeout_h(int sig) {
+	stop_daemons();
+	fprintf(stderr, "%s: Timed out\n", argv0);
+	_exit(1);
+}
+
+/* Whether a test server accepts connections on a port, or on a unix socket */
+
+static bool reachable(const char *port) {
+	struct sockaddr_storage ss;
+	struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+	struct sockaddr_un *sun = (struct sockaddr_un *)&ss;
+	bool result;
+	int sock;
+
+	memset(&ss, 0, sizeof ss);
+
+	if(strchr(port, '/')) {
+		sun->sun_family = AF_UNIX;
+		snprintf(sun->sun_path, sizeof sun->sun_path, "%s", port);
+	} else {
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(atoi(port));
+		sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	}
+
+	if((sock = socket(ss.ss_family, SOCK_STREAM, 0)) == -1)
+		return false;
+
+	result = !connect(sock, (struct sockaddr *)&ss, ss.ss_family == AF_UNIX ? sizeof *sun : sizeof *sin);
+	close(sock);
+	return result;
+}
+
+/* Start a test server on a port, and wait until it accepts connections.
+   With a certificate, it also accepts TLS. */
+
+static pid_t start_daemon(const char *name, const char *port, const char *certfile) {
+	char path[1024];
+	double start = now();
+	pid_t pid;
+
+	snprintf(path, sizeof path, "%s/%s", dir, name);
+
+	if(!(pid = fork())) {
+		if(certfile)
+			execl(path, name, "-c", certfile, "-L", port, NULL);
+		else
+			execl(path, name, "-L", port, NULL);
+		fprintf(stderr, "%s: Could not execute %s: %s\n", argv0, path, strerror(errno));
+		_exit(1);
+	}
+
+	while(now() - start < 2000) {
+		if(reachable(port))
+			return pid;
+
+		usleep(10000);
+	}
+
+	fprintf(stderr, "%s: %s did not start listening on port %s\n", argv0, name, port);
+	return -1;
+}
+
+/* Run a command, feeding it input bytes of input (none if negative), and
+   counting and discarding its output. Returns the time it took in ms, or
+   a negative number if it failed. */
+
+static double run(char *const *argv, long long input, long long *outbytes, long long *errbytes) {
+	static char buf[0x10000];
+	int in[2], out[2], err[2], status, nfds, i;
+	long long *counts[3] = {NULL, outbytes, errbytes};
+	struct pollfd pfd[3];
+	double start = now();
+	ssize_t len;
+	pid_t pid;
+
+	if(pipe(in) || pipe(out) || pipe(err))
+		return -1;
+
+	if(!(pid = fork())) {
+		dup2(in[0], 0);
+		dup2(out[1], 1);
+		dup2(err[1], 2);
+		for(i = 0; i < 2; i++) {
+			close(in[i]);
+			close(out[i]);
+			close(err[i]);
+		}
+		execv(argv[0], argv);
+		_exit(127);
+	}
+
+	close(in[0]);
+	close(out[1]);
+	close(err[1]);
+
+	if(input < 0) {
+		close(in[1]);
+		in[1] = -1;
+	}
+
+	fcntl(in[1], F_SETFL, O_NONBLOCK);
+	memset(buf, 0, sizeof buf);
+	*outbytes = *errbytes = 0;
+
+	pfd[0].fd = in[1];
+	pfd[0].events = POLLOUT;
+	pfd[1].fd = out[0];
+	pfd[1].events = POLLIN;
+	pfd[2].fd = err[0];
+	pfd[2].events = POLLIN;
+
+	for(nfds = 3; pfd[1].fd != -1 || pfd[2].fd != -1;) {
+		if(poll(pfd, nfds, -1) == -1) {
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+
+		if(pfd[0].fd != -1 && pfd[0].revents) {
+			len = write(in[1], buf, input < (long long)sizeof buf ? input : (long long)sizeof buf);
+
+			if(len > 0)
+				input -= len;
+
+			if(!input || (len == -1 && errno != EAGAIN)) {
+				close(in[1]);
+				pfd[0].fd = -1;
+			}
+		}
+
+		for(i = 1; i < 3; i++) {
+			if(pfd[i].fd == -1 || !pfd[i].revents)
+				continue;
+
+			if((len = read(pfd[i].fd, buf, sizeof buf)) > 0) {
+				*counts[i] += len;
+			} else if(!len || errno != EINTR) {
+				close(pfd[i].fd);
+				pfd[i].fd = -1;
+			}
+		}
+	}
+
+	if(pfd[0].fd != -1)
+		close(pfd[0].fd);
+
+	if(waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status))
+		return -1;
+
+	return now() - start;
+}
+
+/* Run rlogin on a pseudo terminal, type a line, and wait for it to exit.
+   Returns the time it took in ms, or a negative number if it failed. */
+
+static double run_tty(const char *line, long long *outbytes) {
+	static char buf[0x10000];
+	char path[1024];
+	struct pollfd pfd;
+	double start = now();
+	int master, status;
+	bool typed = false;
+	ssize_t len;
+	pid_t pid;
+
+	snprintf(path, sizeof path, "%s/rlogin", dir);
+
+	if((pid = forkpty(&master, NULL, NULL, NULL)) == -1)
+		return -1;
+
+	if(!pid) {
+		execl(path, "rlogin", "-p", rloginport, "127.0.0.1", NULL);
+		_exit(127);
+	}
+
+	*outbytes = 0;
+	pfd.fd = master;
+	pfd.events = POLLIN;
+
+	for(;;) {
+		if(poll(&pfd, 1, typed ? -1 : 20) == -1) {
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+
+		/* Type the line once the remote shell is there */
+
+		if(!pfd.revents) {
+			if(*outbytes && !typed && write(master, line, strlen(line)) > 0)
+				typed = true;
+			continue;
+		}
+
+		if((len = read(master, buf, sizeof buf)) <= 0)
+			break;
+
+		*outbytes += len;
+	}
+
+	close(master);
+
+	if(waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status))
+		return -1;
+
+	return now() - start;
+}
+
+static int compare(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double median(double *values, int n) {
+	qsort(values, n, sizeof *values, compare);
+	return values[n / 2];
+}
+
+/* Results of a previous report to compare with */
+
+struct result {
+	char name[64];
+	double value;
+	char unit[16];
+};
+
+static struct result previous[64];
+static int nprevious;
+static bool failed;
+
+static void result(const char *name, double value, const char *unit) {
+	const struct result *p = NULL;
+	bool better;
+	double change;
+	int i;
+
+	if(value < 0) {
+		printf("%-24s %12s %-10s\n", name, "FAILED", unit);
+		failed = true;
+		fflush(stdout);
+		return;
+	}
+
+	for(i = 0; i < nprevious; i++)
+		if(!strcmp(previous[i].name, name))
+			p = &previous[i];
+
+	printf("%-24s %12.2f %-10s", name, value, unit);
+
+	/* Times are better when lower, everything else when higher */
+
+	if(p && p->value > 0) {
+		change = (value - p->value) / p->value * 100;
+		better = strcmp(unit, "ms") ? change > 0 : change < 0;
+		printf(" %+7.1f%%%s", change, !better && change * change > 100 ? "  <-- worse" : "");
+	}
+
+	printf("\n");
+	fflush(stdout);
+}
+
+static bool read_previous(const char *filename) {
+	char line[256];
+	FILE *f;
+	struct result *p;
+
+	if(!(f = fopen(filename, "r")))
+		return false;
+
+	while(nprevious < 64 && fgets(line, sizeof line, f)) {
+		p = &previous[nprevious];
+		if(sscanf(line, "%63s %lf %15s", p->name, &p->value, p->unit) == 3)
+			nprevious++;
+	}
+
+	fclose(f);
+	return true;
+}
+
+/* The rsh command line, over TLS to its own server if asked */
+
+static void rsh_argv(char **argv, char *path, size_t pathlen, const char *host, const char *command, bool tls) {
+	snprintf(path, pathlen, "%s/rsh", dir);
+	*argv++ = path;
+
+	if(tls)
+		*argv++ = "-e";
+
+	*argv++ = "-p";
+	*argv++ = tls ? tlsport : rshport;
+	*argv++ = (char *)host;
+	*argv++ = (char *)command;
+	*argv = NULL;
+}
+
+/* Bulk transfer through rsh, reporting the median throughput */
+
+static void bench_bulk(const char *name, const char *host, const char *command, long long input, bool tls) {
+	char path[1024], *argv[7];
+	double times[REPEAT], t;
+	long long out, err;
+	int i;
+
+	rsh_argv(argv, path, sizeof path, host, command, tls);
+
+	for(i = 0; i < REPEAT; i++) {
+		t = run(argv, input, &out, &err);
+
+		if(t < 0 || (input < 0 && out + err != BULK)) {
+			result(name, -1, "MB/s");
+			return;
+		}
+
+		times[i] = t;
+	}
+
+	result(name, BULK / 1e3 / median(times, REPEAT), "MB/s");
+}
+
+static void bench_latency(const char *name, const char *host, bool tls) {
+	char path[1024], p90[64], *argv[7];
+	double times[LATENCY_RUNS];
+	long long out, err;
+	int i;
+
+	rsh_argv(argv, path, sizeof path, host, "true", tls);
+	snprintf(p90, sizeof p90, "%s.p90", name);
+
+	for(i = 0; i < LATENCY_RUNS; i++) {
+		if((times[i] = run(argv, -1, &out, &err)) < 0) {
+			result(name, -1, "ms");
+			return;
+		}
+	}
+
+	qsort(times, LATENCY_RUNS, sizeof *times, compare);
+	result(name, times[LATENCY_RUNS / 2], "ms");
+	result(p90, times[LATENCY_RUNS * 9 / 10], "ms");
+}
+
+/* Time from fork and exec until the client connects, which is all spent on
+   starting up. Nothing answers the connection, the client is killed once it
+   has been accepted. */
+
+static double run_startup(const char *path, int lsock, const char *port) {
+	char *argv[] = {(char *)path, "-p", (char *)port, "127.0.0.1", "true", NULL};
+	double start = now(), t = -1;
+	struct pollfd pfd = {lsock, POLLIN};
+	int sock, status;
+	pid_t pid;
+
+	if(!(pid = fork())) {
+		int fd = open("/dev/null", O_RDWR);
+		dup2(fd, 0);
+		dup2(fd, 1);
+		dup2(fd, 2);
+		execv(path, argv);
+		_exit(127);
+	}
+
+	if(pid == -1)
+		return -1;
+
+	if(poll(&pfd, 1, 5000) == 1 && (sock = accept(lsock, NULL, NULL)) != -1) {
+		t = now() - start;
+		close(sock);
+	}
+
+	kill(pid, SIGKILL);
+	waitpid(pid, &status, 0);
+	return t;
+}
+
+static void bench_startup(const char *name, const char *client) {
+	char path[1024], port[16];
+	struct sockaddr_in sin;
+	socklen_t slen = sizeof sin;
+	double times[LATENCY_RUNS];
+	int lsock, i;
+
+	snprintf(path, sizeof path, "%s/%s", dir, client);
+
+	if(access(path, X_OK))
+		return;
+
+	memset(&sin, 0, sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if((lsock = socket(AF_INET, SOCK_STREAM, 0)) == -1
+			|| bind(lsock, (struct sockaddr *)&sin, sizeof sin)
+			|| listen(lsock, 16)
+			|| getsockname(lsock, (struct sockaddr *)&sin, &slen)) {
+		result(name, -1, "ms");
+		return;
+	}
+
+	snprintf(port, sizeof port, "%d", ntohs(sin.sin_port));
+
+	for(i = 0; i < LATENCY_RUNS; i++) {
+		if((times[i] = run_startup(path, lsock, port)) < 0) {
+			close(lsock);
+			result(name, -1, "ms");
+			return;
+		}
+	}
+
+	close(lsock);
+	result(name, median(times, LATENCY_RUNS), "ms");
+}
+
+/* Many short sessions, a few at the same time */
+
+static void bench_sessions(void) {
+	char path[1024];
+	char *argv[] = {path, "-p", rshport, "127.0.0.1", "true", NULL};
+	double start = now();
+	int started = 0, running = 0, status;
+	bool ok = true;
+	pid_t pid;
+
+	snprintf(path, sizeof path, "%s/rsh", dir);
+
+	while(started < SESSIONS || running) {
+		while(started < SESSIONS && running < PARALLEL) {
+			if(!(pid = fork())) {
+				int fd = open("/dev/null", O_RDWR);
+				dup2(fd, 0);
+				dup2(fd, 1);
+				execv(path, argv);
+				_exit(127);
+			}
+
+			if(pid == -1)
+				break;
+
+			started++;
+			running++;
+		}
+
+		if(wait(&status) == -1)
+			break;
+
+		if(!WIFEXITED(status) || WEXITSTATUS(status))
+			ok = false;
+
+		running--;
+	}
+
+	result("rsh.sessions", ok ? SESSIONS * 1e3 / (now() - start) : -1, "sessions/s");
+}
+
+/* The same sessions through the library, all from this one process */
+
+static void bench_library(void) {
+	struct rsh_options o = {.port = rshport};
+	struct rsh_session *sessions[PARALLEL] = {NULL};
+	struct pollfd pfd[PARALLEL * RSH_POLLFDS];
+	double start = now();
+	int started = 0, finished = 0, timeout, t, n, i, j;
+	bool ok = true;
+
+	while(finished < SESSIONS) {
+		timeout = -1;
+
+		for(i = 0; i < PARALLEL; i++) {
+			if(!sessions[i] && started < SESSIONS) {
+				started++;
+				if(!(sessions[i] = rsh_start("127.0.0.1", "true", &o))) {
+					ok = false;
+					finished++;
+				}
+			}
+
+			n = 0;
+
+			if(sessions[i] && (t = rsh_pollfds(sessions[i], pfd + i * RSH_POLLFDS, &n)) >= 0 && (timeout == -1 || t < timeout))
+				timeout = t;
+
+			for(j = n; j < RSH_POLLFDS; j++)
+				pfd[i * RSH_POLLFDS + j].fd = -1;
+		}
+
+		if(poll(pfd, PARALLEL * RSH_POLLFDS, timeout) == -1 && errno != EINTR)
+			break;
+
+		for(i = 0; i < PARALLEL; i++) {
+			if(!sessions[i] || !rsh_step(sessions[i], pfd + i * RSH_POLLFDS))
+				continue;
+
+			if(rsh_error(sessions[i]) || rsh_status(sessions[i]))
+				ok = false;
+
+			rsh_free(sessions[i]);
+			sessions[i] = NULL;
+			finished++;
+		}
+	}
+
+	result("librsh.sessions", ok && finished == SESSIONS ? SESSIONS * 1e3 / (now() - start) : -1, "sessions/s");
+}
+
+/* Sessions that are all open at the same time, more than rsh could have
+   with the privileged ports there are. They go to the rexec service, which
+   doesn't need those. Each runs cat, which waits for input, so they stay
+   open until the last one runs. At most WINDOW of them are connecting at
+   any time, so the server's listen queue doesn't overflow. */
+
+static void bench_concurrent(void) {
+	static struct rsh_session *sessions[CONCURRENT];
+	static struct pollfd pfd[CONCURRENT * RSH_POLLFDS];
+	static bool counted[CONCURRENT];
+	struct rsh_options o = {.port = rexecport, .password = PASSWORD};
+	double start = now(), setup = -1;
+	int started = 0, running = 0, peak = 0, finished = 0, timeout, t, n, i, j;
+	bool ok = true;
+
+	while(finished < CONCURRENT) {
+		timeout = -1;
+
+		for(i = 0; i < CONCURRENT; i++) {
+			if(!sessions[i] && started == i && started - running - finished < WINDOW) {
+				started++;
+				if(!(sessions[i] = rsh_start("127.0.0.1", "cat", &o))) {
+					ok = false;
+					finished++;
+				}
+			}
+
+			n = 0;
+
+			if(sessions[i] && (t = rsh_pollfds(sessions[i], pfd + i * RSH_POLLFDS, &n)) >= 0 && (timeout == -1 || t < timeout))
+				timeout = t;
+
+			for(j = n; j < RSH_POLLFDS; j++)
+				pfd[i * RSH_POLLFDS + j].fd = -1;
+		}
+
+		if(poll(pfd, CONCURRENT * RSH_POLLFDS, timeout) == -1 && errno != EINTR)
+			break;
+
+		for(i = 0; i < CONCURRENT; i++) {
+			if(!sessions[i])
+				continue;
+
+			if(rsh_step(sessions[i], pfd + i * RSH_POLLFDS)) {
+				if(rsh_error(sessions[i]) || rsh_status(sessions[i]))
+					ok = false;
+
+				if(counted[i])
+					running--;
+
+				rsh_free(sessions[i]);
+				sessions[i] = NULL;
+				finished++;
+				continue;
+			}
+
+			if(!counted[i] && rsh_room(sessions[i]) > 0) {
+				counted[i] = true;
+				running++;
+			}
+		}
+
+		if(running > peak)
+			peak = running;
+
+		/* Once all of them got this far, let them finish */
+
+		if(setup < 0 && started == CONCURRENT && running + finished == CONCURRENT) {
+			setup = now() - start;
+
+			for(i = 0; i < CONCURRENT; i++)
+				if(sessions[i])
+					rsh_close(sessions[i]);
+		}
+	}
+
+	result("rexec.concurrent", ok && peak == CONCURRENT ? peak : -1, "sessions");
+	result("rexec.concurrent.setup", ok ? setup : -1, "ms");
+}
+
+static void bench_rlogin(void) {
+	char line[256];
+	double times[REPEAT], t;
+	long long out;
+	int i;
+
+	for(i = 0; i < REPEAT; i++) {
+		if((times[i] = run_tty("exit\n", &out)) < 0) {
+			result("rlogin.session", -1, "ms");
+			break;
+		}
+	}
+
+	if(i == REPEAT)
+		result("rlogin.session", median(times, REPEAT), "ms");
+
+	/* Output through both terminals */
+
+	snprintf(line, sizeof line, "stty raw -echo; head -c %d /dev/zero; exit\n", TTYBULK);
+
+	for(i = 0; i < REPEAT; i++) {
+		t = run_tty(line, &out);
+
+		if(t < 0 || out < TTYBULK) {
+			result("rlogin.stdout", -1, "MB/s");
+			return;
+		}
+
+		times[i] = t;
+	}
+
+	result("rlogin.stdout", TTYBULK / 1e3 / median(times, REPEAT), "MB/s");
+}
+
+int main(int argc, char **argv) {
+	char command[256], date[64], certfile[1024];
+	time_t t = time(NULL);
+	int opt, base;
+
+	argv0 = argv[0];
+
+	while((opt = getopt(argc, argv, "d:c:")) != -1) {
+		switch(opt) {
+			case 'd':
+				dir = optarg;
+				break;
+			case 'c':
+				if(!read_previous(optarg)) {
+					fprintf(stderr, "%s: Could not read %s: %s\n", argv0, optarg, strerror(errno));
+					return 1;
+				}
+				break;
+			default:
+				usage();
+				return 1;
+		}
+	}
+
+	/* Pick ports that are unlikely to be in use by another run */
+
+	base = 20000 + getpid() % 11000 * 4;
+	snprintf(rshport, sizeof rshport, "%d", base);
+	snprintf(rloginport, sizeof rloginport, "%d", base + 1);
+	snprintf(rexecport, sizeof rexecport, "%d", base + 2);
+	snprintf(tlsport, sizeof tlsport, "%d", base + 3);
+	snprintf(rshsock, sizeof rshsock, "%s/rshd.%d.sock", dir, (int)getpid());
+
+	signal(SIGALRM, timeout_h);
+	alarm(TIMEOUT);
+	atexit(stop_daemons);
+
+	/* What the test build of in.rexecd wants to hear, see pamstub.c */
+
+	setenv("PAMSTUB_PASSWORD", PASSWORD, 1);
+
+	/* The self-signed certificate made by the Makefile is its own CA */
+
+	snprintf(certfile, sizeof certfile, "%s/cert.pem", dir);
+	setenv("RSH_CAFILE", certfile, 1);
+
+	if((daemons[0] = start_daemon("in.rshd", rshport, NULL)) == -1
+			|| (daemons[1] = start_daemon("in.rlogind", rloginport, NULL)) == -1
+			|| (daemons[2] = start_daemon("in.rshd", rshsock, NULL)) == -1
+			|| (daemons[3] = start_daemon("in.rexecd", rexecport, NULL)) == -1
+			|| (daemons[4] = start_daemon("in.rshd", tlsport, certfile)) == -1)
+		return 1;
+
+	strftime(date, sizeof date, "%Y-%m-%d %H:%M:%S", localtime(&t));
+	printf("# rsh-redone loopback benchmark, %s\n", date);
+	printf("# %-22s %12s %-10s\n", "test", "result", "unit");
+
+	snprintf(command, sizeof command, "head -c %d /dev/zero", BULK);
+	bench_bulk("rsh.stdout", "127.0.0.1", command, -1, false);
+	bench_bulk("rsh.unix.stdout", rshsock, command, -1, false);
+	bench_bulk("rsh.tls.stdout", "127.0.0.1", command, -1, true);
+	bench_bulk("rsh.stdin", "127.0.0.1", "cat >/dev/null", BULK, false);
+	bench_bulk("rsh.unix.stdin", rshsock, "cat >/dev/null", BULK, false);
+	bench_bulk("rsh.tls.stdin", "127.0.0.1", "cat >/dev/null", BULK, true);
+	snprintf(command, sizeof command, "head -c %d /dev/zero >&2", BULK);
+	bench_bulk("rsh.stderr", "127.0.0.1", command, -1, false);
+	bench_latency("rsh.latency", "127.0.0.1", false);
+	bench_latency("rsh.unix.latency", rshsock, false);
+	bench_latency("rsh.tls.latency", "127.0.0.1", true);
+	bench_startup("rsh.startup", "rsh");
+	bench_startup("rsh-static.startup", "rsh-static");
+	bench_sessions();
+	bench_library();
+	bench_concurrent();
+	bench_rlogin();
+
+	return failed;
+}
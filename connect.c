@@ -0,0 +1,1207 @@
+/*
+    connect.c - connection setup shared by the clients
+    Copyright (C) 2026  agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/poll.h>
+#include <sys/random.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+
+#include "connect.h"
+
+/* Bind a socket to a free privileged port.
+   The address is built directly instead of being looked up, and the search
+   starts at a random port, so many clients starting at the same time don't
+   all collide on the same ports. If reuse is set, ports still in TIME_WAIT
+   may be reused; connect() will refuse a connection that would duplicate
+   an existing one. Returns the port number, or -1 with errno set. */
+
+int bindresvport_af(int sock, int family, bool reuse) {
+	struct sockaddr_storage ss;
+	struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+	socklen_t sslen;
+	unsigned int start;
+	int one = 1, count = RESVPORT_LAST - RESVPORT_FIRST + 1, port, i;
+
+	memset(&ss, 0, sizeof ss);
+
+	switch(family) {
+		case AF_INET:
+			sin->sin_family = AF_INET;
+			sin->sin_addr.s_addr = htonl(INADDR_ANY);
+			sslen = sizeof *sin;
+			break;
+		case AF_INET6:
+			sin6->sin6_family = AF_INET6;
+			sin6->sin6_addr = in6addr_any;
+			sslen = sizeof *sin6;
+			break;
+		default:
+			errno = EAFNOSUPPORT;
+			return -1;
+	}
+
+	if(reuse)
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+
+	if(getrandom(&start, sizeof start, GRND_NONBLOCK) != sizeof start)
+		start = getpid() ^ time(NULL);
+
+	for(i = 0; i < count; i++) {
+		port = RESVPORT_FIRST + (start + i) % count;
+
+		if(family == AF_INET)
+			sin->sin_port = htons(port);
+		else
+			sin6->sin6_port = htons(port);
+
+		if(!bind(sock, (struct sockaddr *)&ss, sslen))
+			return port;
+
+		if(errno != EADDRINUSE)
+			return -1;
+	}
+
+	errno = EADDRINUSE;
+	return -1;
+}
+
+/* Unix sockets. A target with a slash in it is the path of one, which is
+   only reachable from the same host, so there are no names to look up, and
+   no privileged ports: the server asks the kernel who connected. */
+
+static bool unix_path(const char *path, struct sockaddr_un *sun) {
+	if(strlen(path) >= sizeof sun->sun_path) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+
+	memset(sun, 0, sizeof *sun);
+	sun->sun_family = AF_UNIX;
+	strcpy(sun->sun_path, path);
+	return true;
+}
+
+int connect_unix(const char *path) {
+	struct sockaddr_un sun;
+	int sock, err;
+
+	if(!unix_path(path, &sun) || (sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+
+	if(connect(sock, (struct sockaddr *)&sun, sizeof sun)) {
+		err = errno;
+		close(sock);
+		errno = err;
+		return -1;
+	}
+
+	return sock;
+}
+
+/* Anyone can connect, peer_allowed() decides who gets in */
+
+static int listen_unix(const char *path) {
+	struct sockaddr_un sun;
+	struct stat st;
+	int sock;
+
+	if(!unix_path(path, &sun) || (sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+
+	/* Replace the socket of an earlier run, but nothing else */
+
+	if(!lstat(path, &st) && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	if(bind(sock, (struct sockaddr *)&sun, sizeof sun) || chmod(path, 0666) || listen(sock, 128)) {
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+/* Whether the peer on a unix socket may say it is user. Root can say it is
+   anyone, just like a client on a privileged port, everyone else can only
+   say who they are. */
+
+bool peer_allowed(int fd, const char *user) {
+	struct ucred cred;
+	socklen_t len = sizeof cred;
+	struct passwd *pw;
+
+	if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+		return false;
+
+	if(!cred.uid)
+		return true;
+
+	return (pw = getpwnam(user)) && pw->pw_uid == cred.uid;
+}
+
+/* Run as our own listener instead of from inetd. Fork a new process for
+   every connection, and return in it with the connection on standard input,
+   output and error. Since we own the listening sockets, we can let clients
+   send their request along with the SYN (TCP Fast Open). Test builds only
+   listen on the loopback interface, everything else on all addresses.
+   A port with a slash in it is the path of a unix socket to listen on. */
+
+#define LISTENERS 8
+
+void serve_standalone(const char *port) {
+	struct addrinfo hint, *ai, *aip;
+	struct pollfd pfd[LISTENERS];
+	int nfds = 0, sock, one = 1, qlen = 64, err, i;
+
+	if(strchr(port, '/')) {
+		if((sock = listen_unix(port)) == -1) {
+			fprintf(stderr, "Could not listen on %s: %s\n", port, strerror(errno));
+			exit(1);
+		}
+
+		pfd[nfds].fd = sock;
+		pfd[nfds++].events = POLLIN;
+		goto serve;
+	}
+
+	memset(&hint, 0, sizeof hint);
+	hint.ai_family = AF_UNSPEC;
+	hint.ai_socktype = SOCK_STREAM;
+	hint.ai_flags = AI_PASSIVE;
+
+#ifdef TESTMODE
+	err = getaddrinfo("127.0.0.1", port, &hint, &ai);
+#else
+	err = getaddrinfo(NULL, port, &hint, &ai);
+#endif
+
+	if(err) {
+		fprintf(stderr, "Error looking up port %s: %s\n", port, gai_strerror(err));
+		exit(1);
+	}
+
+	for(aip = ai; aip && nfds < LISTENERS; aip = aip->ai_next) {
+		if((sock = socket(aip->ai_family, aip->ai_socktype, aip->ai_protocol)) == -1)
+			continue;
+
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+		if(aip->ai_family == AF_INET6)
+			setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof one);
+
+		/* Without server support in net.ipv4.tcp_fastopen this does nothing */
+
+		setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof qlen);
+
+		if(bind(sock, aip->ai_addr, aip->ai_addrlen) || listen(sock, 128)) {
+			fprintf(stderr, "Could not listen on port %s: %s\n", port, strerror(errno));
+			close(sock);
+			continue;
+		}
+
+		pfd[nfds].fd = sock;
+		pfd[nfds++].events = POLLIN;
+	}
+
+	freeaddrinfo(ai);
+
+	if(!nfds)
+		exit(1);
+
+serve:
+	signal(SIGCHLD, SIG_IGN);
+
+	for(;;) {
+		if(poll(pfd, nfds, -1) == -1)
+			continue;
+
+		for(i = 0; i < nfds; i++) {
+			if(!pfd[i].revents || (sock = accept(pfd[i].fd, NULL, NULL)) == -1)
+				continue;
+
+			switch(fork()) {
+				case -1:
+					break;
+				case 0:
+					for(i = 0; i < nfds; i++)
+						close(pfd[i].fd);
+					signal(SIGCHLD, SIG_DFL);
+					dup2(sock, 0);
+					dup2(sock, 1);
+					dup2(sock, 2);
+					if(sock > 2)
+						close(sock);
+					return;
+			}
+
+			close(sock);
+		}
+	}
+}
+
+/* Parse a comma separated list of bulk transfer settings, starting from the defaults.
+   Returns false if one of them is not valid. */
+
+bool tuning_parse(struct tuning *t, char *options) {
+	static char *const tokens[] = {"rate", "rtt", "cc", "lowat", NULL};
+	char *value;
+
+	memset(t, 0, sizeof *t);
+	t->rate = 1000;
+	t->congestion = "bbr";
+	t->lowat = 0x20000;
+
+	while(options && *options) {
+		switch(getsubopt(&options, tokens, &value)) {
+			case 0:
+				if(!value || (t->rate = atoi(value)) <= 0)
+					return false;
+				break;
+			case 1:
+				if(!value || (t->rtt = atoi(value)) < 0)
+					return false;
+				break;
+			case 2:
+				if(!value)
+					return false;
+				t->congestion = *value ? value : NULL;
+				break;
+			case 3:
+				if(!value || (t->lowat = atoi(value)) < 0)
+					return false;
+				break;
+			default:
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/* The largest buffer the kernel would grow a socket buffer to on its own */
+
+static int autotune_max(const char *name) {
+	FILE *f = fopen(name, "r");
+	int min, def, max = 0;
+
+	if(f) {
+		if(fscanf(f, "%d %d %d", &min, &def, &max) != 3)
+			max = 0;
+		fclose(f);
+	}
+
+	return max;
+}
+
+static int setbuf_force(int sock, int force, int opt, int size) {
+	if(setsockopt(sock, SOL_SOCKET, force, &size, sizeof size) && setsockopt(sock, SOL_SOCKET, opt, &size, sizeof size))
+		return 0;
+
+	return size;
+}
+
+/* Apply the bulk transfer settings to a connected socket.
+   The socket buffers are sized to twice the bandwidth-delay product, using
+   the round trip time the kernel measured during the handshake, but only
+   if that is more than automatic tuning would give us, since setting them
+   turns automatic tuning off. Returns false if the congestion control
+   algorithm could not be selected, the other settings are best effort. */
+
+bool tuning_apply(int sock, struct tuning *t) {
+	struct tcp_info info;
+	socklen_t len = sizeof info;
+	long long bdp;
+	int size;
+
+	t->rttus = t->rtt * 1000;
+
+	if(!t->rttus && !getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len))
+		t->rttus = info.tcpi_rtt;
+
+	bdp = (long long)t->rate * 1000000 / 8 * t->rttus / 1000000;
+	size = bdp * 2 > 0x10000000 ? 0x10000000 : bdp * 2;
+
+	if(size > autotune_max("/proc/sys/net/ipv4/tcp_wmem"))
+		t->sndbuf = setbuf_force(sock, SO_SNDBUFFORCE, SO_SNDBUF, size);
+	if(size > autotune_max("/proc/sys/net/ipv4/tcp_rmem"))
+		t->rcvbuf = setbuf_force(sock, SO_RCVBUFFORCE, SO_RCVBUF, size);
+
+	/* Don't let unsent data pile up in the kernel, where we can't see it */
+
+	if(t->lowat)
+		setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &t->lowat, sizeof t->lowat);
+
+	if(t->congestion) {
+		if(setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, t->congestion, strlen(t->congestion)))
+			return false;
+		t->congested = true;
+	}
+
+	return true;
+}
+
+/* Hold back partial segments, to send a burst of small writes in one go */
+
+void tuning_cork(int sock, bool on) {
+	int value = on;
+
+	setsockopt(sock, IPPROTO_TCP, TCP_CORK, &value, sizeof value);
+}
+
+/* Milliseconds between two points in time, or since a point in time if until is NULL */
+
+double elapsed(const struct timespec *since, const struct timespec *until) {
+	struct timespec now;
+
+	if(!until) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		until = &now;
+	}
+
+	return (until->tv_sec - since->tv_sec) * 1e3 + (until->tv_nsec - since->tv_nsec) / 1e6;
+}
+
+/* A timeout in seconds, which may have a fraction, in milliseconds.
+   Returns -1 if it is not a number or not positive. */
+
+int parse_timeout(const char *str) {
+	double seconds;
+	char *end;
+
+	errno = 0;
+	seconds = strtod(str, &end);
+
+	if(end == str || *end || errno || !(seconds > 0) || seconds > INT_MAX / 1000)
+		return -1;
+
+	/* A timeout of 0 means none at all */
+
+	return seconds * 1000 < 1 ? 1 : seconds * 1000;
+}
+
+bool connector_init(struct connector *c, struct addrinfo *ai, int timeout, bool verbose) {
+	struct addrinfo *aip, *same, *other;
+	int i, n = 0;
+
+	memset(c, 0, sizeof *c);
+	c->sock = -1;
+	c->timeout = timeout;
+	c->verbose = verbose;
+	clock_gettime(CLOCK_MONOTONIC, &c->start);
+
+	for(aip = ai; aip; aip = aip->ai_next)
+		n++;
+
+	if(!n) {
+		c->error = EADDRNOTAVAIL;
+		return false;
+	}
+
+	if(!(c->attempts = calloc(n, sizeof *c->attempts))) {
+		c->error = errno;
+		return false;
+	}
+
+	c->nattempts = n;
+	c->slots = n;
+
+	/* Interleave the address families, starting with the one the resolver
+	   prefers, so a broken IPv6 setup doesn't delay IPv4 or vice versa */
+
+	same = other = ai;
+
+	for(i = 0; i < n;) {
+		while(same && same->ai_family != ai->ai_family)
+			same = same->ai_next;
+		if(same) {
+			c->attempts[i++].ai = same;
+			same = same->ai_next;
+		}
+
+		while(other && other->ai_family == ai->ai_family)
+			other = other->ai_next;
+		if(other) {
+			c->attempts[i++].ai = other;
+			other = other->ai_next;
+		}
+	}
+
+	for(i = 0; i < n; i++)
+		c->attempts[i].sock = -1;
+
+	return true;
+}
+
+static void attempt_finish(struct attempt *a, int error) {
+	a->done = true;
+	a->error = error;
+	clock_gettime(CLOCK_MONOTONIC, &a->end);
+
+	if(error && a->sock != -1) {
+		close(a->sock);
+		a->sock = -1;
+	}
+}
+
+/* Start connecting, with the data in the SYN if there is any. Returns like
+   connect() on a non-blocking socket. Without a cookie from an earlier
+   connection to the same server, the kernel asks for one and sends nothing. */
+
+static int attempt_connect(struct connector *c, struct attempt *a) {
+	ssize_t result;
+
+	a->sent = 0;
+
+	if(c->data) {
+		if((result = sendto(a->sock, c->data, c->datalen, MSG_FASTOPEN, a->ai->ai_addr, a->ai->ai_addrlen)) >= 0) {
+			a->sent = result;
+			errno = EINPROGRESS;
+			return -1;
+		}
+
+		/* Fast Open is disabled for clients, fall back to a normal connect */
+
+		if(errno != EOPNOTSUPP)
+			return -1;
+	}
+
+	return connect(a->sock, a->ai->ai_addr, a->ai->ai_addrlen);
+}
+
+static void attempt_start(struct connector *c, struct attempt *a) {
+	char hostaddr[NI_MAXHOST];
+	char portnr[NI_MAXSERV];
+	int i;
+
+	a->started = true;
+	clock_gettime(CLOCK_MONOTONIC, &a->start);
+	c->last = a->start;
+
+	if(c->verbose && !getnameinfo(a->ai->ai_addr, a->ai->ai_addrlen, hostaddr, sizeof hostaddr, portnr, sizeof portnr, NI_NUMERICHOST | NI_NUMERICSERV))
+		fprintf(stderr, "Trying %s port %s...\n", hostaddr, portnr);
+
+	/* Bind to a privileged port, unless the server doesn't care. If another
+	   connection from the same port to the same address is still around,
+	   connect() fails with EADDRNOTAVAIL, in which case we just try another
+	   port. */
+
+	for(i = 0; i < 16; i++) {
+		if((a->sock = socket(a->ai->ai_family, a->ai->ai_socktype | SOCK_NONBLOCK, a->ai->ai_protocol)) == -1)
+			break;
+
+		if(!c->anyport && bindresvport_af(a->sock, a->ai->ai_family, true) == -1)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &a->bound);
+
+		if(!attempt_connect(c, a)) {
+			attempt_finish(a, 0);
+			if(!c->winner)
+				c->winner = a;
+			return;
+		}
+
+		if(errno == EINPROGRESS) {
+			c->pending++;
+			return;
+		}
+
+		if(errno != EADDRNOTAVAIL)
+			break;
+
+		close(a->sock);
+		a->sock = -1;
+	}
+
+	attempt_finish(a, errno);
+	c->error = a->error;
+}
+
+/* Whether the next attempt has a slot, the attempt that used it before
+   has to be done */
+
+static bool connector_canstart(const struct connector *c) {
+	return c->next < c->nattempts && (c->next < c->slots || c->attempts[c->next - c->slots].done);
+}
+
+/* Set up the file descriptors to poll for, returns the poll() timeout */
+
+int connector_pollfds(struct connector *c, struct pollfd *pfd) {
+	int timeout = -1, left, i;
+
+	for(i = 0; i < c->slots; i++) {
+		pfd[i].fd = -1;
+		pfd[i].events = POLLOUT;
+		pfd[i].revents = 0;
+	}
+
+	for(i = 0; i < c->next; i++)
+		if(c->attempts[i].started && !c->attempts[i].done)
+			pfd[i % c->slots].fd = c->attempts[i].sock;
+
+	if(connector_canstart(c) && !(c->data && c->pending)) {
+		timeout = CONNECT_DELAY - elapsed(&c->last, NULL) + 1;
+		if(timeout < 0)
+			timeout = 0;
+	}
+
+	if(c->timeout) {
+		left = c->timeout - elapsed(&c->start, NULL) + 1;
+		if(left < 0)
+			left = 0;
+		if(timeout == -1 || left < timeout)
+			timeout = left;
+	}
+
+	return timeout;
+}
+
+/* Process the results of poll(), if any, and start new attempts when it is time.
+   Returns 1 when a connection has been made, -1 if all attempts failed,
+   and 0 if we are still waiting. */
+
+int connector_step(struct connector *c, const struct pollfd *pfd) {
+	struct attempt *a;
+	socklen_t len;
+	int error, i;
+
+	if(pfd) {
+		for(i = 0; i < c->next; i++) {
+			a = &c->attempts[i];
+
+			if(!a->started || a->done || pfd[i % c->slots].fd != a->sock || !pfd[i % c->slots].revents)
+				continue;
+
+			len = sizeof error;
+			if(getsockopt(a->sock, SOL_SOCKET, SO_ERROR, &error, &len))
+				error = errno;
+
+			c->pending--;
+			attempt_finish(a, error);
+
+			if(error)
+				c->error = error;
+			else if(!c->winner)
+				c->winner = a;
+		}
+	}
+
+	/* Start the next attempt right away if nothing is pending anymore,
+	   otherwise give the pending ones a head start */
+
+	while(!c->winner && connector_canstart(c) && (!c->pending || (!c->data && elapsed(&c->last, NULL) >= CONNECT_DELAY)))
+		attempt_start(c, &c->attempts[c->next++]);
+
+	if(c->winner) {
+		for(i = 0; i < c->nattempts; i++) {
+			a = &c->attempts[i];
+			if(a != c->winner && a->started && !a->done)
+				attempt_finish(a, ECANCELED);
+		}
+
+		c->pending = 0;
+		c->sock = c->winner->sock;
+		fcntl(c->sock, F_SETFL, fcntl(c->sock, F_GETFL) & ~O_NONBLOCK);
+		return 1;
+	}
+
+	if(c->timeout && elapsed(&c->start, NULL) >= c->timeout) {
+		for(i = 0; i < c->nattempts; i++) {
+			a = &c->attempts[i];
+			if(a->started && !a->done)
+				attempt_finish(a, ETIMEDOUT);
+		}
+
+		c->pending = 0;
+		c->error = ETIMEDOUT;
+		return -1;
+	}
+
+	if(!c->pending && c->next == c->nattempts)
+		return -1;
+
+	return 0;
+}
+
+static const char *fastopen_result(const struct attempt *a) {
+	struct tcp_info info;
+	socklen_t len = sizeof info;
+
+	if(!a->sent)
+		return "no Fast Open cookie yet, request sent after the handshake";
+
+	if(getsockopt(a->sock, IPPROTO_TCP, TCP_INFO, &info, &len) || !(info.tcpi_options & TCPI_OPT_SYN_DATA))
+		return "request sent with the SYN, but the server did not take it";
+
+	return "request accepted with the SYN";
+}
+
+/* Show how long each attempt took, and how it ended */
+
+void connector_report(const struct connector *c) {
+	const struct attempt *a;
+	char hostaddr[NI_MAXHOST];
+	char portnr[NI_MAXSERV];
+	int i;
+
+	for(i = 0; i < c->nattempts; i++) {
+		a = &c->attempts[i];
+
+		if(!a->started)
+			continue;
+
+		if(getnameinfo(a->ai->ai_addr, a->ai->ai_addrlen, hostaddr, sizeof hostaddr, portnr, sizeof portnr, NI_NUMERICHOST | NI_NUMERICSERV))
+			continue;
+
+		if(a == c->winner) {
+			fprintf(stderr, "  %s port %s: connected after %.1f ms, %.1f ms of which finding a free port\n", hostaddr, portnr, elapsed(&a->start, &a->end), elapsed(&a->start, &a->bound));
+			if(c->data)
+				fprintf(stderr, "  %s\n", fastopen_result(a));
+		}
+		else if(a->error == ECANCELED)
+			fprintf(stderr, "  %s port %s: abandoned after %.1f ms\n", hostaddr, portnr, elapsed(&a->start, &a->end));
+		else
+			fprintf(stderr, "  %s port %s: %s after %.1f ms\n", hostaddr, portnr, strerror(a->error), elapsed(&a->start, &a->end));
+	}
+}
+
+void connector_free(struct connector *c) {
+	int i;
+
+	for(i = 0; i < c->nattempts; i++)
+		if(c->attempts[i].sock != -1 && c->attempts[i].sock != c->sock)
+			close(c->attempts[i].sock);
+
+	free(c->attempts);
+	c->attempts = NULL;
+	c->nattempts = 0;
+}
+
+/* Connect to one of the addresses from a privileged port, or from any port
+   if anyport is set, waiting at most timeout milliseconds (0 to wait forever). Returns the socket, and the
+   address it is connected to in winner, or -1 with errno set. If bindtime
+   is not NULL, it is set to the time it took to find a free port.
+   If data is not NULL, as much of it as possible is sent along with the SYN,
+   and sent is set to how much that was; the caller has to send the rest. */
+
+int connect_resv(struct addrinfo *ai, int timeout, bool verbose, bool anyport, const char *data, int datalen, int *sent, struct addrinfo **winner, double *bindtime) {
+	struct connector c;
+	struct pollfd *pfd;
+	int result, sock = -1;
+
+	if(!connector_init(&c, ai, timeout, verbose)) {
+		errno = c.error;
+		return -1;
+	}
+
+	c.anyport = anyport;
+	c.data = data;
+	c.datalen = datalen;
+
+	if(!(pfd = calloc(c.slots, sizeof *pfd))) {
+		connector_free(&c);
+		return -1;
+	}
+
+	result = connector_step(&c, NULL);
+
+	while(!result) {
+		if(poll(pfd, c.slots, connector_pollfds(&c, pfd)) == -1 && errno != EINTR) {
+			c.error = errno;
+			break;
+		}
+
+		result = connector_step(&c, pfd);
+	}
+
+	if(verbose)
+		connector_report(&c);
+
+	if(result == 1) {
+		sock = c.sock;
+		*winner = c.winner->ai;
+		if(sent)
+			*sent = c.winner->sent;
+		if(bindtime)
+			*bindtime = elapsed(&c.winner->start, &c.winner->bound);
+	}
+
+	free(pfd);
+	connector_free(&c);
+
+	if(sock == -1)
+		errno = c.error ? c.error : ECONNREFUSED;
+
+	return sock;
+}
+
+/* Persistent cache of resolved addresses, in a file in the user's runtime
+   directory that is shared by all clients through mmap(). For every host
+   and port it records the addresses it resolved to, which of those the last
+   connection went to, and how long connecting took. Within CACHE_TTL
+   seconds of the lookup, the addresses are used without asking the
+   resolver again. After that they are looked up again, but the address that
+   worked last time is still tried first, so a broken address family doesn't
+   cost us a timeout on every connection. */
+
+#define CACHE_FILE "rsh-cache"
+#define CACHE_MAGIC 0x72736832
+#define CACHE_ENTRIES 128
+#define CACHE_ADDRS 4
+#define CACHE_TTL 300
+
+struct cache_addr {
+	int family;
+	int socktype;
+	int protocol;
+	socklen_t len;
+	struct sockaddr_storage addr;
+};
+
+struct cache_entry {
+	char host[256];
+	char port[32];
+	int family;
+	time_t resolved;
+	time_t used;
+	int naddrs;
+	int good;		/* The address the last connection went to, or -1 */
+	float latency;
+	struct cache_addr addrs[CACHE_ADDRS];
+};
+
+struct cache {
+	uint32_t magic;
+	uint32_t size;		/* sizeof(struct cache) */
+	uint32_t lookups;
+	uint32_t hits;
+	struct cache_entry entries[CACHE_ENTRIES];
+};
+
+static struct cache *cache;
+static int cachefd = -1;
+
+/* Open the cache as the user, not as root, the path is theirs to choose */
+
+static bool cache_open(void) {
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	char path[4096];
+	struct stat st;
+	uid_t euid = geteuid();
+	void *map;
+	int fd;
+
+	if(cache)
+		return true;
+
+	if(!dir || *dir != '/' || snprintf(path, sizeof path, "%s/" CACHE_FILE, dir) >= sizeof path)
+		return false;
+
+	if(seteuid(getuid()))
+		return false;
+
+	fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+
+	if(seteuid(euid) || fd == -1) {
+		if(fd != -1)
+			close(fd);
+		return false;
+	}
+
+	if(fstat(fd, &st) || st.st_uid != getuid() || (st.st_size < sizeof *cache && ftruncate(fd, sizeof *cache))) {
+		close(fd);
+		return false;
+	}
+
+	if((map = mmap(NULL, sizeof *cache, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+
+	cache = map;
+	cachefd = fd;
+
+	flock(cachefd, LOCK_EX);
+	if(cache->magic != CACHE_MAGIC || cache->size != sizeof *cache) {
+		memset(cache, 0, sizeof *cache);
+		cache->magic = CACHE_MAGIC;
+		cache->size = sizeof *cache;
+	}
+	flock(cachefd, LOCK_UN);
+
+	return true;
+}
+
+/* The file belongs to the user, who can write anything into it, while a
+   setuid client is going to connect to the addresses in it. Only use
+   entries that make sense. */
+
+static bool cache_valid(const struct cache_entry *e) {
+	int i;
+
+	if(!memchr(e->host, 0, sizeof e->host) || !memchr(e->port, 0, sizeof e->port))
+		return false;
+
+	if(e->naddrs < 0 || e->naddrs > CACHE_ADDRS || e->good < -1 || e->good >= e->naddrs)
+		return false;
+
+	for(i = 0; i < e->naddrs; i++) {
+		if(e->addrs[i].family == AF_INET) {
+			if(e->addrs[i].len != sizeof(struct sockaddr_in))
+				return false;
+		} else if(e->addrs[i].family == AF_INET6) {
+			if(e->addrs[i].len != sizeof(struct sockaddr_in6))
+				return false;
+		} else {
+			return false;
+		}
+
+		if(e->addrs[i].addr.ss_family != e->addrs[i].family)
+			return false;
+	}
+
+	return true;
+}
+
+static struct cache_entry *cache_find(const struct lookup *l) {
+	struct cache_entry *e;
+	int i;
+
+	for(i = 0; i < CACHE_ENTRIES; i++) {
+		e = &cache->entries[i];
+		if(e->used && cache_valid(e) && e->family == l->family && !strcmp(e->host, l->host) && !strcmp(e->port, l->port))
+			return e;
+	}
+
+	return NULL;
+}
+
+static struct addrinfo *cache_node(int family, int socktype, int protocol, const void *addr, socklen_t len) {
+	struct addrinfo *ai;
+
+	if(len > sizeof(struct sockaddr_storage) || !(ai = calloc(1, sizeof *ai + sizeof(struct sockaddr_storage))))
+		return NULL;
+
+	ai->ai_family = family;
+	ai->ai_socktype = socktype;
+	ai->ai_protocol = protocol;
+	ai->ai_addrlen = len;
+	ai->ai_addr = (struct sockaddr *)(ai + 1);
+	memcpy(ai->ai_addr, addr, len);
+	return ai;
+}
+
+static bool same_addr(const struct addrinfo *ai, const struct cache_addr *a) {
+	return ai->ai_family == a->family && ai->ai_addrlen == a->len && !memcmp(ai->ai_addr, &a->addr, a->len);
+}
+
+/* Look up the addresses of a host, with the one that worked last first.
+   The result has to be freed with lookup_free(). Returns 0, or an error
+   code of getaddrinfo(). */
+
+int lookup_host(struct lookup *l) {
+	struct addrinfo hint, *res = NULL, *aip, **tail, *node;
+	struct cache_entry *e = NULL, copy;
+	int err, i;
+
+	l->ai = NULL;
+	l->hit = false;
+	tail = &l->ai;
+
+	if(cache_open()) {
+		flock(cachefd, LOCK_EX);
+		cache->lookups++;
+		if((e = cache_find(l))) {
+			copy = *e;
+
+			/* Check the copy, the file can be written without taking the lock */
+
+			if(!cache_valid(&copy))
+				e = NULL;
+		}
+		if(e && !l->bypass && copy.naddrs && time(NULL) - copy.resolved < CACHE_TTL) {
+			cache->hits++;
+			l->hit = true;
+		}
+		flock(cachefd, LOCK_UN);
+	}
+
+	if(l->hit) {
+		for(i = 0; i < copy.naddrs; i++) {
+			if(!(node = cache_node(copy.addrs[i].family, copy.addrs[i].socktype, copy.addrs[i].protocol, &copy.addrs[i].addr, copy.addrs[i].len)))
+				break;
+
+			if(i == copy.good) {
+				node->ai_next = l->ai;
+				l->ai = node;
+				if(tail == &l->ai)
+					tail = &node->ai_next;
+			} else {
+				*tail = node;
+				tail = &node->ai_next;
+			}
+		}
+
+		if(l->ai)
+			return 0;
+
+		l->hit = false;
+	}
+
+	memset(&hint, 0, sizeof hint);
+	hint.ai_family = l->family;
+	hint.ai_socktype = SOCK_STREAM;
+
+	if((err = getaddrinfo(l->host, l->port, &hint, &res)))
+		return err;
+
+	/* Copy the result, so cached and looked up addresses are freed the same way */
+
+	for(aip = res; aip; aip = aip->ai_next) {
+		if(!(node = cache_node(aip->ai_family, aip->ai_socktype, aip->ai_protocol, aip->ai_addr, aip->ai_addrlen))) {
+			freeaddrinfo(res);
+			lookup_free(l);
+			return EAI_MEMORY;
+		}
+
+		if(e && copy.good >= 0 && copy.good < copy.naddrs && same_addr(aip, &copy.addrs[copy.good])) {
+			node->ai_next = l->ai;
+			l->ai = node;
+			if(tail == &l->ai)
+				tail = &node->ai_next;
+		} else {
+			*tail = node;
+			tail = &node->ai_next;
+		}
+	}
+
+	freeaddrinfo(res);
+	return 0;
+}
+
+/* Remember how connecting went. If it failed, forget about the host, so the
+   next lookup asks the resolver again. */
+
+void lookup_done(struct lookup *l, const struct addrinfo *winner, double latency) {
+	struct cache_entry *e, *oldest;
+	const struct addrinfo *aip;
+	time_t now = time(NULL);
+	int i;
+
+	if(!cache)
+		return;
+
+	flock(cachefd, LOCK_EX);
+
+	if(!(e = cache_find(l))) {
+		oldest = &cache->entries[0];
+		for(i = 1; i < CACHE_ENTRIES; i++)
+			if(cache->entries[i].used < oldest->used)
+				oldest = &cache->entries[i];
+		e = oldest;
+		memset(e, 0, sizeof *e);
+		e->good = -1;
+	}
+
+	if(!winner || strlen(l->host) >= sizeof e->host || strlen(l->port) >= sizeof e->port) {
+		memset(e, 0, sizeof *e);
+		flock(cachefd, LOCK_UN);
+		return;
+	}
+
+	strcpy(e->host, l->host);
+	strcpy(e->port, l->port);
+	e->family = l->family;
+	e->used = now;
+	e->latency = latency;
+
+	if(!l->hit) {
+		e->resolved = now;
+		e->naddrs = 0;
+
+		for(aip = l->ai; aip && e->naddrs < CACHE_ADDRS; aip = aip->ai_next) {
+			if(aip->ai_addrlen > sizeof e->addrs[0].addr)
+				continue;
+
+			e->addrs[e->naddrs].family = aip->ai_family;
+			e->addrs[e->naddrs].socktype = aip->ai_socktype;
+			e->addrs[e->naddrs].protocol = aip->ai_protocol;
+			e->addrs[e->naddrs].len = aip->ai_addrlen;
+			memcpy(&e->addrs[e->naddrs].addr, aip->ai_addr, aip->ai_addrlen);
+			e->naddrs++;
+		}
+	}
+
+	e->good = -1;
+
+	for(i = 0; i < e->naddrs; i++)
+		if(same_addr(winner, &e->addrs[i]))
+			e->good = i;
+
+	flock(cachefd, LOCK_UN);
+}
+
+void lookup_free(struct lookup *l) {
+	struct addrinfo *next;
+
+	while(l->ai) {
+		next = l->ai->ai_next;
+		free(l->ai);
+		l->ai = next;
+	}
+}
+
+void lookup_report(const struct lookup *l) {
+	if(!cache) {
+		fprintf(stderr, "No address cache for %s\n", l->host);
+		return;
+	}
+
+	fprintf(stderr, "Address cache %s for %s, %u of %u lookups hit (%.0f%%)\n", l->hit ? "hit" : l->bypass ? "bypassed" : "miss", l->host, cache->hits, cache->lookups, cache->lookups ? 100.0 * cache->hits / cache->lookups : 0.0);
+}
+
+/* The name of the user running us. Looking it up can mean asking a
+   directory service over the network, which takes longer than everything
+   else we do before connecting, so names that were looked up are kept in
+   USERCACHE for USERCACHE_TTL seconds. Only root can write that file, since
+   servers trust the name we send them. When we are not running setuid, the
+   name is not worth protecting: without root we can't get the privileged
+   port that makes servers trust it. Then $USER is good enough, except for
+   root itself, which keeps the $USER of whoever it su'd from.
+
+   Returns NULL with errno set if there is no name, ENOENT if the uid has
+   no entry in the password database. */
+
+#define USERCACHE "/run/rsh-users"
+#define USERCACHE_TTL 3600
+
+static bool usercache_trusted(int fd) {
+	struct stat st;
+
+	return !fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_uid == 0 && !(st.st_mode & 022);
+}
+
+static char *usercache_get(uid_t uid) {
+	char line[512], name[256];
+	unsigned long id;
+	long long stamp;
+	char *result = NULL;
+	FILE *file;
+	int fd;
+
+	if((fd = open(USERCACHE, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) == -1)
+		return NULL;
+
+	if(!usercache_trusted(fd) || !(file = fdopen(fd, "r"))) {
+		close(fd);
+		return NULL;
+	}
+
+	while(!result && fgets(line, sizeof line, file))
+		if(sscanf(line, "%lu %255s %lld", &id, name, &stamp) == 3 && id == uid && time(NULL) - stamp < USERCACHE_TTL)
+			result = strdup(name);
+
+	fclose(file);
+	return result;
+}
+
+static void usercache_put(uid_t uid, const char *name) {
+	char line[512], tmp[64];
+	unsigned long id;
+	FILE *in, *out;
+	int fd;
+
+	if(geteuid() || strlen(name) > 255 || strpbrk(name, " \t\n"))
+		return;
+
+	snprintf(tmp, sizeof tmp, USERCACHE ".%d", (int)getpid());
+
+	if((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644)) == -1)
+		return;
+
+	if(!(out = fdopen(fd, "w"))) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+
+	/* Keep the entries of other users */
+
+	if((fd = open(USERCACHE, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) != -1) {
+		if(usercache_trusted(fd) && (in = fdopen(fd, "r"))) {
+			while(fgets(line, sizeof line, in))
+				if(sscanf(line, "%lu", &id) == 1 && id != uid)
+					fputs(line, out);
+			fclose(in);
+		} else {
+			close(fd);
+		}
+	}
+
+	fprintf(out, "%lu %s %lld\n", (unsigned long)uid, name, (long long)time(NULL));
+
+	if(fclose(out) || rename(tmp, USERCACHE))
+		unlink(tmp);
+}
+
+char *local_user(void) {
+	static char *name;
+	struct passwd *pw;
+	uid_t uid = getuid();
+
+	if(name)
+		return name;
+
+	if((name = usercache_get(uid)))
+		return name;
+
+	if(uid && uid == geteuid() && (name = getenv("USER")) && *name)
+		return name;
+
+	errno = 0;
+
+	if(!(pw = getpwuid(uid))) {
+		if(!errno)
+			errno = ENOENT;
+		return name = NULL;
+	}
+
+	name = strdup(pw->pw_name);
+	usercache_put(uid, pw->pw_name);
+	return name;
+}
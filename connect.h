@@ -0,0 +1,135 @@
+/*
+    connect.h - connection setup shared by the clients
+    Copyright (C) 2026  agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef CONNECT_H
+#define CONNECT_H
+
+#include <stdbool.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/poll.h>
+
+/* Delay before starting the next connection attempt, see RFC 8305 */
+
+#define CONNECT_DELAY 250
+
+/* A single connection attempt to one of the addresses of a host */
+
+struct attempt {
+	struct addrinfo *ai;
+	int sock;
+	int error;
+	bool started;
+	bool done;
+	int sent;
+	struct timespec start;
+	struct timespec bound;
+	struct timespec end;
+};
+
+/* Staggered, parallel connection attempts to all addresses of a host.
+   The first attempt that succeeds wins, the others are abandoned.
+   With data to send in the SYN (TCP Fast Open), only one attempt runs at a
+   time, since the server might act on the data of an abandoned one.
+   At most slots attempts run at once, attempt i uses pollfd i % slots. */
+
+struct connector {
+	struct attempt *attempts;
+	int nattempts;
+	int slots;
+	int next;
+	int pending;
+	int timeout;
+	bool verbose;
+	bool anyport;		/* Don't bind to a privileged port, see rexec */
+	const char *data;
+	int datalen;
+	struct timespec start;
+	struct timespec last;
+	struct attempt *winner;
+	int sock;
+	int error;
+};
+
+/* Socket settings for bulk transfers over long, fast links */
+
+struct tuning {
+	int rate;		/* Expected bandwidth in Mbit/s */
+	int rtt;		/* Round trip time in ms, or 0 to measure it */
+	char *congestion;	/* Congestion control algorithm, or NULL */
+	int lowat;		/* Limit on unsent data in the socket, or 0 */
+
+	/* What was actually used */
+
+	int rttus;
+	int sndbuf, rcvbuf;
+	bool congested;
+};
+
+extern bool tuning_parse(struct tuning *t, char *options);
+extern bool tuning_apply(int sock, struct tuning *t);
+extern void tuning_cork(int sock, bool on);
+
+extern int bindresvport_af(int sock, int family, bool reuse);
+
+/* The ports bindresvport_af() picks from, and whether a port is one only
+   root can bind to. Test builds run without root, so they use ephemeral
+   ports instead, and accept any port. */
+
+#ifdef TESTMODE
+#define RESVPORT_FIRST 32768
+#define RESVPORT_LAST 60999
+#define RESVPORT(port) true
+#else
+#define RESVPORT_FIRST 512
+#define RESVPORT_LAST 1023
+#define RESVPORT(port) ((port) >= RESVPORT_FIRST && (port) <= RESVPORT_LAST)
+#endif
+
+extern void serve_standalone(const char *port);
+extern int connect_unix(const char *path);
+extern bool peer_allowed(int fd, const char *user);
+extern char *local_user(void);
+extern double elapsed(const struct timespec *since, const struct timespec *until);
+extern int parse_timeout(const char *str);
+
+extern bool connector_init(struct connector *c, struct addrinfo *ai, int timeout, bool verbose);
+extern int connector_pollfds(struct connector *c, struct pollfd *pfd);
+extern int connector_step(struct connector *c, const struct pollfd *pfd);
+extern void connector_report(const struct connector *c);
+extern void connector_free(struct connector *c);
+
+/* Looking up the addresses of a host, through a persistent cache */
+
+struct lookup {
+	const char *host;
+	const char *port;
+	int family;
+	bool bypass;		/* Ask the resolver, but still update the cache */
+	bool hit;
+	struct addrinfo *ai;
+};
+
+extern int lookup_host(struct lookup *l);
+extern void lookup_done(struct lookup *l, const struct addrinfo *winner, double latency);
+extern void lookup_free(struct lookup *l);
+extern void lookup_report(const struct lookup *l);
+
+extern int connect_resv(struct addrinfo *ai, int timeout, bool verbose, bool anyport, const char *data, int datalen, int *sent, struct addrinfo **winner, double *bindtime);
+
+#endif
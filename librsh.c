@@ -0,0 +1,634 @@
+/*
+    librsh.c - running remote commands without a process per command
+    Copyright (C) 2003  Guus Sliepen <guus@sliepen.eu.org>
+    Copyright (C) 2026  agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "connect.h"
+#include "protocol.h"
+#include "librsh.h"
+
+/* Make sure everything gets written */
+
+static ssize_t safewrite(int fd, const void *buf, size_t count) {
+	int written = 0, result;
+
+	while(count) {
+		result = write(fd, buf, count);
+		if(result == -1) {
+			if(errno == EINTR)
+				continue;
+			else
+				return result;
+		}
+		written += result;
+		buf += result;
+		count -= result;
+	}
+
+	return written;
+}
+
+/* Safe and fast string building */
+
+static void safecpy(char **dest, int *len, const char *source, bool terminate) {
+	while(*source && *len) {
+		*(*dest)++ = *source++;
+		(*len)--;
+	}
+
+	if(terminate && *len) {
+		*(*dest)++ = 0;
+		(*len)--;
+	}
+}
+
+/* Create a socket on a privileged port for the incoming stderr connection,
+   or on any port if anyport is set. A port in TIME_WAIT is fine for listening on, but one that is in use
+   by another connection only fails once we call listen(). */
+
+int listen_stderr(int family, bool anyport, char *lport, size_t lportlen) {
+	struct sockaddr_storage ss;
+	socklen_t sslen = sizeof ss;
+	int lsock = -1, lportnr = -1, zero = 0, i;
+
+	for(i = 0; i < 16; i++) {
+		if((lsock = socket(family, SOCK_STREAM, 0)) == -1)
+			return -1;
+
+		/* Accept IPv4 connections as well, so it works for either family */
+
+		if(family == AF_INET6)
+			setsockopt(lsock, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof zero);
+
+		if(anyport) {
+			if(!listen(lsock, 10) && !getsockname(lsock, (struct sockaddr *)&ss, &sslen)) {
+				lportnr = ntohs(((struct sockaddr_in *)&ss)->sin_port);
+				break;
+			}
+
+			close(lsock);
+			return -1;
+		}
+
+		if((lportnr = bindresvport_af(lsock, family, true)) == -1) {
+			close(lsock);
+			return -1;
+		}
+
+		if(!listen(lsock, 10))
+			break;
+
+		close(lsock);
+		lsock = -1;
+
+		if(errno != EADDRINUSE)
+			return -1;
+	}
+
+	if(lsock == -1) {
+		errno = EADDRINUSE;
+		return -1;
+	}
+
+	snprintf(lport, lportlen, "%d", lportnr);
+	return lsock;
+}
+
+/* Join the arguments into a single command */
+
+void build_command(char **bufp, int *len, int argc, char **argv) {
+	int i;
+
+	for(i = 0; i < argc; i++) {
+		safecpy(bufp, len, argv[i], 0);
+		if(i < argc - 1)
+			safecpy(bufp, len, " ", 0);
+	}
+	safecpy(bufp, len, "", 1);
+}
+
+/* Build the request to send to the server. Returns its length, or -1 if it doesn't fit. */
+
+int build_request(char *buf, int len, const char *lport, const char *luser, const char *user, int argc, char **argv) {
+	char *bufp = buf;
+
+	safecpy(&bufp, &len, lport, 1);
+	safecpy(&bufp, &len, luser, 1);
+	safecpy(&bufp, &len, user, 1);
+	build_command(&bufp, &len, argc, argv);
+
+	if(!len)
+		return -1;
+
+	return bufp - buf;
+}
+
+/* Pick the features we want from those the server offers */
+
+static void select_features(const char *offer, const char *want, char *answer, size_t answerlen) {
+	char wanted[1024];
+	char *feature;
+
+	*answer = 0;
+	snprintf(wanted, sizeof wanted, "%s", want);
+
+	for(feature = strtok(wanted, ","); feature; feature = strtok(NULL, ",")) {
+		if(!feature_has(offer, feature) || strlen(answer) + strlen(feature) + 2 > answerlen)
+			continue;
+		if(*answer)
+			strcat(answer, ",");
+		strcat(answer, feature);
+	}
+}
+
+/* Read the server's answer to a request that was sent with PROTO_MARK.
+   If the server offers extensions, pick those we want, and tell it which.
+   Returns 1 if framing is used from now on, in which case the features the
+   server offers are in offer, 0 if the classic protocol is, and -1 on error. */
+
+int negotiate(int sock, const char *want, char *offer, size_t offerlen) {
+	char answer[1024];
+	size_t len = 0;
+
+	errno = 0;
+	*offer = 0;
+
+	if(read(sock, offer, 1) != 1 || (*offer && *offer != *PROTO_OFFER)) {
+		/* An rexec server that didn't accept the password */
+
+		if(*offer == 1)
+			errno = EACCES;
+		return -1;
+	}
+
+	if(!*offer)
+		return 0;
+
+	/* Read the offered features */
+
+	do {
+		if(len == offerlen || read(sock, offer + len, 1) != 1)
+			return -1;
+	} while(offer[len++]);
+
+	select_features(offer, want, answer, sizeof answer);
+
+	if(safewrite(sock, answer, strlen(answer) + 1) == -1)
+		return -1;
+
+	return 1;
+}
+
+/* Sessions. The request goes out with port 0 for stderr, so the server
+   never has to connect back to us, which would cost another privileged
+   port per session. Everything else happens in rsh_step(), whenever one
+   of the file descriptors is ready. */
+
+enum {
+	RSH_CONNECTING,
+	RSH_ANSWERING,		/* Waiting for the NULL byte or the offer */
+	RSH_OFFERED,		/* Reading the rest of the offer */
+	RSH_RUNNING,
+	RSH_DONE,
+	RSH_FAILED,
+};
+
+struct rsh_session {
+	int state;
+	char error[256];
+	struct rsh_options opt;
+	char *host;
+	char *port;
+
+	struct lookup lookup;
+	struct connector conn;
+	int sock;
+
+	bool framed;
+	bool closing;		/* No more input, still has to be sent */
+	bool closed;
+	int status;
+
+	struct codec *codec;
+	struct framebuf in, out;
+};
+
+static void rsh_fail(struct rsh_session *s, const char *what, int err) {
+	snprintf(s->error, sizeof s->error, "%s%s%s", what, err ? ": " : "", err ? strerror(err) : "");
+	s->state = RSH_FAILED;
+
+	connector_free(&s->conn);
+	lookup_free(&s->lookup);
+
+	if(s->sock != -1)
+		close(s->sock);
+
+	s->sock = -1;
+}
+
+static void rsh_finish(struct rsh_session *s, int status) {
+	s->status = status;
+	s->state = RSH_DONE;
+	close(s->sock);
+	s->sock = -1;
+}
+
+static void rsh_output(struct rsh_session *s, int fd, const char *data, int len) {
+	if(s->opt.output)
+		s->opt.output(s, fd, data, len, s->opt.arg);
+}
+
+/* Add bytes to a buffer that doesn't hold frames */
+
+static void raw_put(struct framebuf *b, const void *data, int len) {
+	memcpy(b->buf + b->len, data, len);
+	b->len += len;
+}
+
+struct rsh_session *rsh_start(const char *host, const char *command, const struct rsh_options *o) {
+	struct rsh_session *s;
+	char *argv[] = {(char *)command};
+	const char *luser;
+	int err, len;
+
+	if(!(s = calloc(1, sizeof *s)))
+		return NULL;
+
+	if(o)
+		s->opt = *o;
+
+	s->sock = -1;
+	s->status = -1;
+
+	if(!(luser = s->opt.luser ? s->opt.luser : local_user())
+			|| !(s->host = strdup(host))
+			|| !(s->port = strdup(s->opt.port ? s->opt.port : s->opt.password ? "exec" : "shell"))) {
+		rsh_free(s);
+		return NULL;
+	}
+
+	/* The request is sent as soon as we are connected. For rexec, the
+	   remote user and the password take the place of the two user names. */
+
+	if(s->opt.password)
+		len = build_request(s->out.buf, FRAMEBUF, "00", s->opt.user ? s->opt.user : luser, s->opt.password, 1, argv);
+	else
+		len = build_request(s->out.buf, FRAMEBUF, "00", luser, s->opt.user ? s->opt.user : luser, 1, argv);
+
+	if(len == -1) {
+		rsh_free(s);
+		errno = E2BIG;
+		return NULL;
+	}
+
+	s->out.len = len;
+
+	/* A unix socket on this host, see connect_unix() */
+
+	if(strchr(host, '/')) {
+		if((s->sock = connect_unix(host)) == -1) {
+			rsh_fail(s, "Could not make a connection", errno);
+			return s;
+		}
+
+		fcntl(s->sock, F_SETFL, fcntl(s->sock, F_GETFL) | O_NONBLOCK);
+		framebuf_write(s->sock, &s->out);
+		s->state = RSH_ANSWERING;
+		return s;
+	}
+
+	s->lookup.host = s->host;
+	s->lookup.port = s->port;
+	s->lookup.family = s->opt.family;
+
+	if((err = lookup_host(&s->lookup))) {
+		snprintf(s->error, sizeof s->error, "Error looking up host: %s", gai_strerror(err));
+		s->state = RSH_FAILED;
+		return s;
+	}
+
+	if(!connector_init(&s->conn, s->lookup.ai, s->opt.timeout, false)) {
+		rsh_fail(s, "Could not make a connection", s->conn.error);
+		return s;
+	}
+
+	s->conn.anyport = s->opt.password;
+
+	/* All addresses are tried, but no more than fit in the pollfds at once */
+
+	if(s->conn.slots > RSH_POLLFDS)
+		s->conn.slots = RSH_POLLFDS;
+
+	s->state = RSH_CONNECTING;
+	return s;
+}
+
+int rsh_pollfds(struct rsh_session *s, struct pollfd *pfd, int *nfds) {
+	switch(s->state) {
+		case RSH_CONNECTING:
+			*nfds = s->conn.slots;
+			return connector_pollfds(&s->conn, pfd);
+
+		case RSH_DONE:
+		case RSH_FAILED:
+			*nfds = 0;
+			return 0;
+
+		default:
+			*nfds = 1;
+			pfd->fd = s->sock;
+			pfd->events = POLLIN | (s->out.len ? POLLOUT : 0);
+			pfd->revents = 0;
+			return -1;
+	}
+}
+
+/* Once all input has been sent, tell the server */
+
+static void rsh_eof(struct rsh_session *s) {
+	if(!s->closing || s->closed || s->state != RSH_RUNNING)
+		return;
+
+	if(s->framed) {
+		s->closed = frame_put(&s->out, FRAME_STDIN, 0, NULL, 0);
+	} else if(!s->out.len) {
+		shutdown(s->sock, SHUT_WR);
+		s->closed = true;
+	}
+}
+
+/* The server's answer to the request, and our answer to its offer */
+
+static bool rsh_answer(struct rsh_session *s) {
+	char answer[1024], *offer;
+	int result;
+
+	if(s->state == RSH_ANSWERING) {
+		if((result = read(s->sock, answer, 1)) == -1 && (errno == EINTR || errno == EAGAIN))
+			return true;
+
+		if(result != 1 || (*answer && *answer != *PROTO_OFFER)) {
+			rsh_fail(s, "Didn't receive NULL byte from server", result == -1 ? errno : result == 1 && *answer == 1 ? EACCES : 0);
+			return false;
+		}
+
+		if(!*answer) {
+			s->state = RSH_RUNNING;
+			return true;
+		}
+
+		s->state = RSH_OFFERED;
+	}
+
+	if((result = framebuf_read(s->sock, &s->in)) == -1 && (errno == EINTR || errno == EAGAIN))
+		return true;
+
+	if(result <= 0) {
+		rsh_fail(s, "Didn't receive answer from server", result ? errno : 0);
+		return false;
+	}
+
+	if(!(offer = framebuf_getstr(&s->in)))
+		return true;
+
+	select_features(offer, s->opt.compress ? FEATURE_MUX "," FEATURE_DEFLATE : FEATURE_MUX, answer, sizeof answer);
+
+	if(!feature_has(answer, FEATURE_MUX)) {
+		rsh_fail(s, "Server does not support multiplexing", 0);
+		return false;
+	}
+
+	/* Without compression after all, the answer is just FEATURE_MUX */
+
+	if(feature_has(answer, FEATURE_DEFLATE) && (!(s->codec = malloc(sizeof *s->codec)) || !codec_init(s->codec))) {
+		free(s->codec);
+		s->codec = NULL;
+		answer[strlen(FEATURE_MUX)] = 0;
+	}
+
+	framebuf_room(&s->out);
+	raw_put(&s->out, answer, strlen(answer) + 1);
+
+	s->framed = true;
+	s->state = RSH_RUNNING;
+	return true;
+}
+
+/* Hand the output in all complete frames to the application */
+
+static void rsh_frames(struct rsh_session *s) {
+	struct frame f;
+	char *data;
+	int result, len;
+
+	while(s->state == RSH_RUNNING && (result = frame_peek(&s->in, &f)) == 1) {
+		switch(f.type & ~FRAME_DEFLATE) {
+			case FRAME_READY:
+				break;
+
+			case FRAME_STDOUT:
+			case FRAME_STDERR:
+				if((len = frame_data(s->codec, &f, &data)) == -1) {
+					rsh_fail(s, "Invalid compressed data", 0);
+					return;
+				}
+
+				rsh_output(s, f.type == FRAME_STDOUT ? 1 : 2, data, len);
+				break;
+
+			case FRAME_EXIT:
+				rsh_finish(s, f.len ? (unsigned char)*f.data : -1);
+				return;
+
+			default:
+				rsh_fail(s, "Unexpected frame from server", EPROTO);
+				return;
+		}
+
+		frame_next(&s->in, &f);
+	}
+
+	if(result == -1)
+		rsh_fail(s, "Invalid frame from server", errno);
+}
+
+int rsh_step(struct rsh_session *s, const struct pollfd *pfd) {
+	char buf[FRAME_MAX];
+	int result, one = 1;
+
+	if(s->state == RSH_CONNECTING) {
+		if(!(result = connector_step(&s->conn, pfd)))
+			return 0;
+
+		if(result == -1) {
+			lookup_done(&s->lookup, NULL, 0);
+			rsh_fail(s, "Could not make a connection", s->conn.error ? s->conn.error : ECONNREFUSED);
+			return 1;
+		}
+
+		s->sock = s->conn.sock;
+		lookup_done(&s->lookup, s->conn.winner->ai, elapsed(&s->conn.start, NULL));
+		connector_free(&s->conn);
+		lookup_free(&s->lookup);
+
+		/* Everything is collected in a buffer, don't delay it any further */
+
+		setsockopt(s->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+		s->state = RSH_ANSWERING;
+
+		/* The socket is writable now, no need to wait for that */
+
+		framebuf_write(s->sock, &s->out);
+		return 0;
+	}
+
+	if(s->state == RSH_DONE || s->state == RSH_FAILED)
+		return 1;
+
+	if(!pfd->revents)
+		return 0;
+
+	if(pfd->revents & POLLOUT) {
+		if(framebuf_write(s->sock, &s->out) == -1 && errno != EINTR && errno != EAGAIN) {
+			rsh_fail(s, "Error while sending to server", errno);
+			return 1;
+		}
+
+		rsh_eof(s);
+	}
+
+	if(!(pfd->revents & (POLLIN | POLLHUP | POLLERR)))
+		return 0;
+
+	if(s->state != RSH_RUNNING) {
+		if(!rsh_answer(s))
+			return 1;
+
+		rsh_eof(s);
+		rsh_frames(s);
+		return s->state != RSH_RUNNING;
+	}
+
+	/* The classic protocol has just the output, stderr included, and no exit status */
+
+	if(!s->framed) {
+		if((result = read(s->sock, buf, sizeof buf)) > 0) {
+			rsh_output(s, 1, buf, result);
+		} else if(!result) {
+			rsh_output(s, 1, NULL, 0);
+			rsh_output(s, 2, NULL, 0);
+			rsh_finish(s, -1);
+		} else if(errno != EINTR && errno != EAGAIN) {
+			rsh_fail(s, "Error while receiving from server", errno);
+		}
+
+		return s->state != RSH_RUNNING;
+	}
+
+	if((result = framebuf_read(s->sock, &s->in)) == -1 && (errno == EINTR || errno == EAGAIN))
+		return 0;
+
+	if(result <= 0) {
+		rsh_fail(s, "Connection closed by server", result ? errno : 0);
+		return 1;
+	}
+
+	rsh_frames(s);
+	return s->state != RSH_RUNNING;
+}
+
+int rsh_room(struct rsh_session *s) {
+	int room;
+
+	if(s->state != RSH_RUNNING || s->closing)
+		return 0;
+
+	room = framebuf_room(&s->out);
+
+	if(!s->framed)
+		return room;
+
+	/* Leave room for the frame header, and for data that doesn't compress */
+
+	room -= FRAME_HDR + (s->codec ? 256 : 0);
+
+	if(room > (s->codec ? CODEC_MAX : FRAME_MAX))
+		room = s->codec ? CODEC_MAX : FRAME_MAX;
+
+	return room > 0 ? room : 0;
+}
+
+int rsh_write(struct rsh_session *s, const void *data, int len) {
+	int room = rsh_room(s);
+
+	if(len > room)
+		len = room;
+
+	if(len <= 0)
+		return 0;
+
+	if(!s->framed)
+		raw_put(&s->out, data, len);
+	else if(!frame_put_data(&s->out, s->codec, FRAME_STDIN, 0, data, len))
+		return 0;
+
+	return len;
+}
+
+void rsh_close(struct rsh_session *s) {
+	s->closing = true;
+	rsh_eof(s);
+}
+
+int rsh_status(const struct rsh_session *s) {
+	return s->state == RSH_DONE ? s->status : -1;
+}
+
+const char *rsh_error(const struct rsh_session *s) {
+	return s->state == RSH_FAILED ? s->error : NULL;
+}
+
+void rsh_free(struct rsh_session *s) {
+	connector_free(&s->conn);
+	lookup_free(&s->lookup);
+
+	if(s->sock != -1)
+		close(s->sock);
+
+	if(s->codec) {
+		codec_free(s->codec);
+		free(s->codec);
+	}
+
+	free(s->host);
+	free(s->port);
+	free(s);
+}
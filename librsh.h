@@ -0,0 +1,101 @@
+/*
+    librsh.h - running remote commands without a process per command
+    Copyright (C) 2026  agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef LIBRSH_H
+#define LIBRSH_H
+
+#include <stdbool.h>
+#include <sys/poll.h>
+
+/* A session runs a single command on a remote host. Apart from looking up
+   the host, which goes through the address cache, nothing blocks: the
+   application polls the file descriptors the session asks for, together
+   with its own, and hands the results back to rsh_step(). Output is passed
+   to a callback as soon as it arrives. A host with a slash in it is the
+   path of a unix socket on this host.
+
+   Like rsh itself, this needs root to bind to a privileged port, and the
+   local user name is trusted by the server. With a password, the session
+   goes to the rexec service instead, which needs neither.
+
+   Servers that know about the extensions in protocol.h send everything over
+   the single connection, and tell us the exit status. Older servers send
+   the output of both stdout and stderr over it, there is no separate
+   connection for stderr, and the exit status is not known. */
+
+/* The library is built with everything else hidden, only these are exported */
+
+#pragma GCC visibility push(default)
+
+#define RSH_POLLFDS 4		/* At most this many addresses are tried at once */
+
+struct rsh_session;
+
+struct rsh_options {
+	const char *port;	/* Service or port number, "shell" or "exec" if NULL */
+	const char *luser;	/* Local user name, looked up if NULL */
+	const char *user;	/* Remote user name, the local one if NULL */
+	const char *password;	/* Use rexec with this password if not NULL */
+	int family;		/* AF_INET, AF_INET6 or AF_UNSPEC */
+	int timeout;		/* Connection timeout in ms, or 0 for none */
+	bool compress;		/* Ask for compression if the server has it */
+
+	/* Called with fd 1 or 2, and the data. Without it, output is dropped.
+	   A length of 0 means that stream has ended. */
+
+	void (*output)(struct rsh_session *s, int fd, const char *data, int len, void *arg);
+	void *arg;
+};
+
+/* Start a session. Returns NULL with errno set if it could not be started
+   at all, otherwise errors are reported through rsh_error(). */
+
+extern struct rsh_session *rsh_start(const char *host, const char *command, const struct rsh_options *o);
+
+/* Fill in up to RSH_POLLFDS file descriptors to poll for, and set *nfds to
+   how many there are. Returns the poll() timeout in ms, or -1 for none. */
+
+extern int rsh_pollfds(struct rsh_session *s, struct pollfd *pfd, int *nfds);
+
+/* Process the results of poll(), which may also have timed out. Returns 1
+   once the session has finished, successfully or not, 0 otherwise. */
+
+extern int rsh_step(struct rsh_session *s, const struct pollfd *pfd);
+
+/* Standard input. Returns how much of the data was taken, which can be less
+   than len, and is 0 until the command runs or while the connection can't
+   keep up. rsh_room() tells how much would be taken right now. */
+
+extern int rsh_write(struct rsh_session *s, const void *data, int len);
+extern int rsh_room(struct rsh_session *s);
+extern void rsh_close(struct rsh_session *s);
+
+/* The exit status of the command, 128 plus the signal that killed it,
+   or -1 if it is not known. */
+
+extern int rsh_status(const struct rsh_session *s);
+
+/* What went wrong, or NULL if nothing did */
+
+extern const char *rsh_error(const struct rsh_session *s);
+
+extern void rsh_free(struct rsh_session *s);
+
+#pragma GCC visibility pop
+
+#endif
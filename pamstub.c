@@ -0,0 +1,155 @@
+/*
+    pamstub.c - stand-in for PAM in test builds of the servers
+    Copyright (C) 2026  agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* Test builds run without root and without a PAM configuration.
+   This implements just enough of PAM for the servers, and only lets
+   in the user the server is running as. The rexec service also asks
+   for a password, which has to match $PAMSTUB_PASSWORD. */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <security/pam_appl.h>
+
+#define ENVMAX 64
+
+struct pam_handle {
+	struct pam_conv conv;
+	bool password;
+	char *items[16];
+	char *env[ENVMAX + 1];
+	int nenv;
+};
+
+int pam_start(const char *service, const char *user, const struct pam_conv *conv, pam_handle_t **handle) {
+	if(!(*handle = calloc(1, sizeof **handle)))
+		return PAM_BUF_ERR;
+
+	(*handle)->conv = *conv;
+	(*handle)->password = !strcmp(service, "rexec");
+
+	return user ? pam_set_item(*handle, PAM_USER, user) : PAM_SUCCESS;
+}
+
+int pam_end(pam_handle_t *handle, int status) {
+	int i;
+
+	for(i = 0; i < 16; i++)
+		free(handle->items[i]);
+
+	for(i = 0; i < handle->nenv; i++)
+		free(handle->env[i]);
+
+	free(handle);
+	return PAM_SUCCESS;
+}
+
+int pam_set_item(pam_handle_t *handle, int type, const void *item) {
+	if(type < 0 || type >= 16)
+		return PAM_BAD_ITEM;
+
+	free(handle->items[type]);
+	handle->items[type] = item ? strdup(item) : NULL;
+	return PAM_SUCCESS;
+}
+
+int pam_get_item(const pam_handle_t *handle, int type, const void **item) {
+	if(type < 0 || type >= 16)
+		return PAM_BAD_ITEM;
+
+	*item = handle->items[type];
+	return PAM_SUCCESS;
+}
+
+const char *pam_strerror(pam_handle_t *handle, int err) {
+	return err == PAM_SUCCESS ? "Success" : "Authentication failure";
+}
+
+static bool check_password(pam_handle_t *handle) {
+	struct pam_message msg = {PAM_PROMPT_ECHO_OFF, "Password: "};
+	const struct pam_message *msgv = &msg;
+	struct pam_response *res = NULL;
+	const char *password = getenv("PAMSTUB_PASSWORD");
+	bool ok;
+
+	if(handle->conv.conv(1, &msgv, &res, handle->conv.appdata_ptr) != PAM_SUCCESS)
+		return false;
+
+	ok = password && res->resp && !strcmp(password, res->resp);
+	free(res->resp);
+	free(res);
+	return ok;
+}
+
+int pam_authenticate(pam_handle_t *handle, int flags) {
+	struct passwd *pw = getpwuid(getuid());
+
+	if(!pw || !handle->items[PAM_USER] || strcmp(pw->pw_name, handle->items[PAM_USER]))
+		return PAM_AUTH_ERR;
+
+	if(handle->password && !check_password(handle))
+		return PAM_AUTH_ERR;
+
+	return PAM_SUCCESS;
+}
+
+int pam_chauthtok(pam_handle_t *handle, int flags) {
+	return PAM_AUTH_ERR;
+}
+
+int pam_acct_mgmt(pam_handle_t *handle, int flags) {
+	return PAM_SUCCESS;
+}
+
+int pam_setcred(pam_handle_t *handle, int flags) {
+	return PAM_SUCCESS;
+}
+
+int pam_putenv(pam_handle_t *handle, const char *nameval) {
+	size_t len = strcspn(nameval, "=");
+	int i;
+
+	for(i = 0; i < handle->nenv; i++)
+		if(!strncmp(handle->env[i], nameval, len) && handle->env[i][len] == '=')
+			break;
+
+	if(i == ENVMAX)
+		return PAM_BUF_ERR;
+
+	if(i == handle->nenv)
+		handle->nenv++;
+	else
+		free(handle->env[i]);
+
+	handle->env[i] = strdup(nameval);
+	return PAM_SUCCESS;
+}
+
+char **pam_getenvlist(pam_handle_t *handle) {
+	char **list = calloc(handle->nenv + 1, sizeof *list);
+	int i;
+
+	if(list)
+		for(i = 0; i < handle->nenv; i++)
+			list[i] = strdup(handle->env[i]);
+
+	return list;
+}
@@ -0,0 +1,318 @@
+/*
+    protocol.c - extensions to the rsh protocol
+    Copyright (C) 2026  agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "protocol.h"
+
+/* Check if a comma separated list contains a feature */
+
+bool feature_has(const char *list, const char *feature) {
+	size_t len = strlen(feature);
+
+	while(*list) {
+		if(!strncmp(list, feature, len) && (list[len] == ',' || !list[len]))
+			return true;
+
+		if(!(list = strchr(list, ',')))
+			break;
+
+		list++;
+	}
+
+	return false;
+}
+
+/* Free space at the end of the buffer, after moving the contents to the start */
+
+int framebuf_room(struct framebuf *b) {
+	if(b->start) {
+		memmove(b->buf, b->buf + b->start, b->len);
+		b->start = 0;
+	}
+
+	return FRAMEBUF - b->len;
+}
+
+int framebuf_read(int fd, struct framebuf *b) {
+	int room = framebuf_room(b), result;
+
+	if(!room) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	result = read(fd, b->buf + b->len, room);
+
+	if(result > 0)
+		b->len += result;
+
+	return result;
+}
+
+int framebuf_write(int fd, struct framebuf *b) {
+	int result = write(fd, b->buf + b->start, b->len);
+
+	if(result > 0) {
+		b->start += result;
+		b->len -= result;
+		if(!b->len)
+			b->start = 0;
+	}
+
+	return result;
+}
+
+/* Get a NULL terminated string from the start of the buffer, or NULL if it is incomplete */
+
+char *framebuf_getstr(struct framebuf *b) {
+	char *str = b->buf + b->start, *end;
+
+	if(!(end = memchr(str, 0, b->len)))
+		return NULL;
+
+	b->len -= end + 1 - str;
+	b->start = b->len ? b->start + (end + 1 - str) : 0;
+	return str;
+}
+
+static void frame_header(char *hdr, int type, int chan, int len) {
+	hdr[0] = type;
+	hdr[1] = chan;
+	hdr[2] = len >> 8;
+	hdr[3] = len;
+}
+
+/* Add a frame to the buffer, returns false if it doesn't fit */
+
+bool frame_put(struct framebuf *b, int type, int chan, const void *data, int len) {
+	if(len > FRAME_MAX || framebuf_room(b) < FRAME_HDR + len)
+		return false;
+
+	frame_header(b->buf + b->len, type, chan, len);
+	if(len)
+		memcpy(b->buf + b->len + FRAME_HDR, data, len);
+	b->len += FRAME_HDR + len;
+	return true;
+}
+
+/* Make room for the data of a frame, so it can be read straight into the buffer.
+   Returns NULL if there is no room, otherwise len is set to the maximum length. */
+
+char *frame_reserve(struct framebuf *b, int *len) {
+	int room = framebuf_room(b) - FRAME_HDR;
+
+	if(room <= 0)
+		return NULL;
+
+	*len = room < FRAME_MAX ? room : FRAME_MAX;
+	return b->buf + b->len + FRAME_HDR;
+}
+
+void frame_commit(struct framebuf *b, int type, int chan, int len) {
+	frame_header(b->buf + b->len, type, chan, len);
+	b->len += FRAME_HDR + len;
+}
+
+/* Get the next complete frame from the buffer without removing it.
+   The data stays valid until more is added to the buffer.
+   Returns 1 if there is a frame, 0 if it is incomplete, and -1 if it is invalid. */
+
+int frame_peek(struct framebuf *b, struct frame *f) {
+	unsigned char *hdr = (unsigned char *)b->buf + b->start;
+
+	if(b->len < FRAME_HDR)
+		return 0;
+
+	f->type = hdr[0];
+	f->chan = hdr[1];
+	f->len = hdr[2] << 8 | hdr[3];
+
+	if(f->len > FRAME_MAX) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	if(b->len < FRAME_HDR + f->len)
+		return 0;
+
+	f->data = (char *)hdr + FRAME_HDR;
+	return 1;
+}
+
+void frame_next(struct framebuf *b, const struct frame *f) {
+	b->start += FRAME_HDR + f->len;
+	b->len -= FRAME_HDR + f->len;
+	if(!b->len)
+		b->start = 0;
+}
+
+bool codec_init(struct codec *z) {
+	memset(z, 0, sizeof *z);
+	z->level = z->applied = 1;
+
+	/* Raw deflate streams, the frames already tell us where the data ends */
+
+	if(deflateInit2(&z->def, z->applied, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return false;
+
+	if(inflateInit2(&z->inf, -15) != Z_OK) {
+		deflateEnd(&z->def);
+		return false;
+	}
+
+	z->on = true;
+	return true;
+}
+
+void codec_free(struct codec *z) {
+	if(!z->on)
+		return;
+
+	deflateEnd(&z->def);
+	inflateEnd(&z->inf);
+	z->on = false;
+}
+
+/* Check if there is room for a frame with as much data as we would put in it */
+
+bool frame_canput(struct framebuf *b, const struct codec *z) {
+	return framebuf_room(b) >= FRAME_HDR + (z && z->on ? FRAME_MAX : 1);
+}
+
+/* Pick the level for the next frames. A buffer that is filling up means the
+   connection is slower than we can compress, one that only holds the frame
+   we just added means it is waiting for us. */
+
+static void codec_adapt(struct codec *z, struct framebuf *b, int len, int clen) {
+	if(clen * 16 >= len * 15) {
+		z->bypass = 16;
+		return;
+	}
+
+	if(++z->frames < 8)
+		return;
+
+	if(b->len > FRAMEBUF / 2 && z->level < 9)
+		z->level++;
+	else if(b->len == FRAME_HDR + clen && z->level > 1)
+		z->level--;
+	else
+		return;
+
+	z->frames = 0;
+}
+
+/* Add a frame with data, compressing it if possible. At most CODEC_MAX bytes
+   of data can be compressed. Returns false if it doesn't fit. */
+
+bool frame_put_data(struct framebuf *b, struct codec *z, int type, int chan, const void *data, int len) {
+	char *out;
+	int room, clen;
+
+	if(!z || !z->on || !len || len > CODEC_MAX || z->bypass) {
+		if(!frame_put(b, type, chan, data, len))
+			return false;
+
+		if(z) {
+			z->rawout += len;
+			z->wireout += len;
+			if(z->bypass)
+				z->bypass--;
+		}
+
+		return true;
+	}
+
+	if(!(out = frame_reserve(b, &room)) || room < len + 256)
+		return false;
+
+	z->def.next_out = (Bytef *)out;
+	z->def.avail_out = room;
+
+	/* Changing the level may flush, that output belongs to this frame as well */
+
+	if(z->level != z->applied) {
+		if(deflateParams(&z->def, z->level, Z_DEFAULT_STRATEGY) != Z_OK) {
+			errno = EPROTO;
+			return false;
+		}
+
+		z->applied = z->level;
+	}
+
+	z->def.next_in = (Bytef *)data;
+	z->def.avail_in = len;
+
+	if(deflate(&z->def, Z_SYNC_FLUSH) != Z_OK || z->def.avail_in) {
+		errno = EPROTO;
+		return false;
+	}
+
+	clen = room - z->def.avail_out;
+	frame_commit(b, type | FRAME_DEFLATE, chan, clen);
+
+	z->rawout += len;
+	z->wireout += clen;
+	codec_adapt(z, b, len, clen);
+
+	return true;
+}
+
+/* Get the data of a frame, decompressing it if necessary. This must be
+   called exactly once for every frame that might be compressed.
+   Returns the length of the data, or -1 on error. */
+
+int frame_data(struct codec *z, struct frame *f, char **data) {
+	if(!(f->type & FRAME_DEFLATE)) {
+		*data = f->data;
+
+		if(z) {
+			z->rawin += f->len;
+			z->wirein += f->len;
+		}
+
+		return f->len;
+	}
+
+	f->type &= ~FRAME_DEFLATE;
+
+	if(!z || !z->on) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	z->inf.next_in = (Bytef *)f->data;
+	z->inf.avail_in = f->len;
+	z->inf.next_out = (Bytef *)z->buf;
+	z->inf.avail_out = sizeof z->buf;
+
+	if(inflate(&z->inf, Z_SYNC_FLUSH) != Z_OK || z->inf.avail_in) {
+		errno = EPROTO;
+		return -1;
+	}
+
+	*data = z->buf;
+	z->rawin += sizeof z->buf - z->inf.avail_out;
+	z->wirein += f->len;
+
+	return sizeof z->buf - z->inf.avail_out;
+}
@@ -0,0 +1,138 @@
+/*
+    protocol.h - extensions to the rsh protocol
+    Copyright (C) 2026  agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <zlib.h>
+
+/* A client that knows about the extensions sends the stderr port number with
+   a leading zero. Servers that don't know about them just parse the number
+   as usual. A server that does answers with PROTO_OFFER followed by a comma
+   separated list of features and a NULL byte, instead of the plain NULL
+   byte, and doesn't connect back for stderr. The client then answers with
+   the features it wants, again as a comma separated list terminated by a
+   NULL byte. The server doesn't wait for that answer before it starts the
+   command from the request, so this costs no extra round trip. */
+
+#define PROTO_MARK '0'
+#define PROTO_OFFER "\002"
+
+/* Everything after the offer and the answer is sent as frames over the
+   primary connection. The command from the request runs on channel 0.
+   With "mux", the session ends when it exits.
+   With "session", the client can start more commands with FRAME_EXEC,
+   also while others are still running, and an empty command from the
+   request is not run at all. A command for a channel that is still in use
+   starts once the previous one has exited. The session ends when the client
+   closes the connection and all commands have exited. */
+
+#define FEATURE_MUX "mux"
+#define FEATURE_SESSION "session"
+
+/* With "deflate", STDIN, STDOUT and STDERR frames can have their data
+   compressed, which is marked by FRAME_DEFLATE in the type. Each direction
+   is a single deflate stream, flushed at the end of every frame, so a frame
+   can be decompressed as soon as it arrives, and yields at most FRAME_MAX
+   bytes. Frames without the flag are not part of the stream, so data that
+   doesn't compress well can just be sent as it is. */
+
+#define FEATURE_DEFLATE "deflate"
+
+#define FEATURES FEATURE_MUX "," FEATURE_SESSION "," FEATURE_DEFLATE
+
+/* Frames have a four byte header: the type, the channel and the length of
+   the data in network byte order. An empty STDIN, STDOUT or STDERR frame
+   signals the end of that stream. EXIT carries a single byte, the exit
+   status of the command, or 128 plus the signal that killed it. */
+
+#define FRAME_HDR 4
+#define FRAME_MAX 0xffff
+#define FRAMEBUF 0x40000
+#define CHANNELS 256
+
+enum {
+	FRAME_READY = 1,	/* Server to client: authentication succeeded */
+	FRAME_EXEC,		/* Client to server: run the command in the data */
+	FRAME_STDIN,
+	FRAME_STDOUT,
+	FRAME_STDERR,
+	FRAME_EXIT,
+};
+
+#define FRAME_DEFLATE 0x80
+
+/* Compression of frames in both directions of a connection.
+   The level goes up while the connection can't keep up with us, and down
+   while it is idle. After a frame that didn't compress, the next few are
+   sent as they are, without wasting time on trying to compress them. */
+
+#define CODEC_MAX (FRAME_MAX - 256)
+
+struct codec {
+	z_stream def, inf;
+	bool on;
+	int level, applied;
+	int frames;
+	int bypass;
+	unsigned long long rawout, wireout;
+	unsigned long long rawin, wirein;
+	char buf[FRAME_MAX];
+};
+
+struct frame {
+	int type;
+	int chan;
+	int len;
+	char *data;
+};
+
+struct framebuf {
+	int start, len;
+	char buf[FRAMEBUF];
+};
+
+extern bool feature_has(const char *list, const char *feature);
+
+extern int framebuf_room(struct framebuf *b);
+extern int framebuf_read(int fd, struct framebuf *b);
+extern int framebuf_write(int fd, struct framebuf *b);
+extern char *framebuf_getstr(struct framebuf *b);
+
+extern bool frame_put(struct framebuf *b, int type, int chan, const void *data, int len);
+extern char *frame_reserve(struct framebuf *b, int *len);
+extern void frame_commit(struct framebuf *b, int type, int chan, int len);
+extern int frame_peek(struct framebuf *b, struct frame *f);
+extern void frame_next(struct framebuf *b, const struct frame *f);
+
+extern bool codec_init(struct codec *z);
+extern void codec_free(struct codec *z);
+extern bool frame_canput(struct framebuf *b, const struct codec *z);
+extern bool frame_put_data(struct framebuf *b, struct codec *z, int type, int chan, const void *data, int len);
+extern int frame_data(struct codec *z, struct frame *f, char **data);
+
+/* The steps of the client side, in librsh.c, also used by rsh itself */
+
+extern int listen_stderr(int family, bool anyport, char *lport, size_t lportlen);
+extern void build_command(char **bufp, int *len, int argc, char **argv);
+extern int build_request(char *buf, int len, const char *lport, const char *luser, const char *user, int argc, char **argv);
+extern int negotiate(int sock, const char *want, char *offer, size_t offerlen);
+
+#endif
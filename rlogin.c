@@ -21,7 +21,6 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <unistd.h>
-#include <pwd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/poll.h>
@@ -33,12 +32,15 @@
 #include <sys/ioctl.h>
 #include <fcntl.h>
 
+#include "connect.h"
+#include "tls.h"
+
 #define BUFLEN 0x10000
 
 static char *argv0;
 
 static void usage(void) {
-	fprintf(stderr, "Usage: rlogin [-46v] [-l user] [-p port] [user@]host\n");
+	fprintf(stderr, "Usage: rlogin [-46veTC] [-l user] [-p port] [-t timeout] [user@]host\n");
 }
 
 /* Make sure everything gets written */
@@ -125,23 +127,26 @@ int main(int argc, char **argv) {
 	char *host = NULL;
 	char *port = "login";
 	char *p;
-	char lport[5];
-	
-	struct passwd *pw;
 	
 	int af = AF_UNSPEC;
-	struct addrinfo hint, *ai, *aip, *lai;
-	int err, i;
+	struct lookup lookup = {NULL};
+	struct addrinfo *aip;
+	struct timespec start;
+	int err;
 	
 	int opt;
 
 	bool verbose = false;
+	bool fastopen = false;
+	bool nocache = false;
+	bool tls = false;
+	bool local;
+	int sent = 0;
 
 	int sock = -1;
 	bool winchsupport = false;
 
-	char hostaddr[NI_MAXHOST];
-	char portnr[NI_MAXSERV];
+	int timeout = 0;
 
 	struct termios tios, oldtios;
 	char *term, *speed;
@@ -156,17 +161,9 @@ int main(int argc, char **argv) {
 	
 	argv0 = argv[0];
 	
-	/* Lookup local username */
-	
-	if (!(pw = getpwuid(getuid()))) {
-		fprintf(stderr, "%s: Could not lookup username: %s\n", argv0, strerror(errno));
-		return 1;
-	}
-	user = luser = pw->pw_name;
-	
 	/* Process options */
 			
-	while((opt = getopt(argc, argv, "l:p:46v")) != -1) {
+	while((opt = getopt(argc, argv, "l:p:t:46veTC")) != -1) {
 		switch(opt) {
 			case 'l':
 				user = optarg;
@@ -174,6 +171,13 @@ int main(int argc, char **argv) {
 			case 'p':
 				port = optarg;
 				break;
+			case 't':
+				if((timeout = parse_timeout(optarg)) == -1) {
+					fprintf(stderr, "%s: Invalid timeout!\n", argv0);
+					usage();
+					return 1;
+				}
+				break;
 			case '4':
 				af = AF_INET;
 				break;
@@ -183,6 +187,15 @@ int main(int argc, char **argv) {
 			case 'v':
 				verbose = true;
 				break;
+			case 'e':
+				tls = true;
+				break;
+			case 'T':
+				fastopen = true;
+				break;
+			case 'C':
+				nocache = true;
+				break;
 			default:
 				fprintf(stderr, "%s: Unknown option!\n", argv0);
 				usage();
@@ -210,83 +223,42 @@ int main(int argc, char **argv) {
 		host = p + 1;
 	}
 	
-	/* Resolve hostname and try to make a connection */
-	
-	memset(&hint, '\0', sizeof hint);
-	hint.ai_family = af;
-	hint.ai_socktype = SOCK_STREAM;
-	
-	err = getaddrinfo(host, port, &hint, &ai);
+	/* Lookup local username */
 	
-	if(err) {
-		fprintf(stderr, "%s: Error looking up host: %s\n", argv0, gai_strerror(err));
+	if(!(luser = local_user())) {
+		fprintf(stderr, "%s: Could not lookup username: %s\n", argv0, errno == ENOENT ? "unknown user ID" : strerror(errno));
 		return 1;
 	}
+
+	if(!user)
+		user = luser;
 	
-	hint.ai_flags = AI_PASSIVE;
-	
-	for(aip = ai; aip; aip = aip->ai_next) {
-		if(getnameinfo(aip->ai_addr, aip->ai_addrlen, hostaddr, sizeof hostaddr, portnr, sizeof portnr, NI_NUMERICHOST | NI_NUMERICSERV)) {
-			fprintf(stderr, "%s: Error resolving address: %s\n", argv0, strerror(errno));
-			return 1;
-		}
-		if(verbose) fprintf(stderr, "Trying %s port %s...",	hostaddr, portnr);
-		
-		if((sock = socket(aip->ai_family, aip->ai_socktype, aip->ai_protocol)) == -1) {
-			if(verbose) fprintf(stderr, " Could not open socket: %s\n", strerror(errno));
-			continue;
-		}
+	local = strchr(host, '/');
 
-		hint.ai_family = aip->ai_family;
+	/* Nobody else can see a unix socket, and the request has to wait for the handshake */
 
-		/* Bind to a privileged port */
-		
-		for(i = 1023; i >= 512; i--) {
-			snprintf(lport, sizeof lport, "%d", i);
-			err = getaddrinfo(NULL, lport, &hint, &lai);
-			if(err) {
-				fprintf(stderr, " Error looking up localhost: %s\n", gai_strerror(err));
-				return 1;
-			}
-			
-			err = bind(sock, lai->ai_addr, lai->ai_addrlen);
-			
-			freeaddrinfo(lai);
-			
-			if(err)
-				continue;
-			else
-				break;
-		}
-		
-		if(err) {
-			if(verbose) fprintf(stderr, " Could not bind to privileged port: %s\n", strerror(errno));
-			continue;
-		}
-		
-		if(connect(sock, aip->ai_addr, aip->ai_addrlen) == -1) {
-			if(verbose) fprintf(stderr, " Connection failed: %s\n", strerror(errno));
-			continue;
-		}
-		if(verbose) fprintf(stderr, " Connected.\n");
-		break;
-	}
-	
-	if(!aip) {
-		fprintf(stderr, "%s: Could not make a connection.\n", argv0);
-		return 1;
-	}
-			
-	freeaddrinfo(ai);
+	if(local)
+		tls = false;
+	if(tls)
+		fastopen = false;
 
-	/* Drop privileges */
+	/* Resolve hostname and try to make a connection, unless it is the path
+	   of a unix socket on this host */
 	
-	if(setuid(getuid())) {
-		fprintf(stderr, "%s: Unable to drop privileges: %s\n", argv0, strerror(errno));
+	lookup.host = host;
+	lookup.port = port;
+	lookup.family = af;
+	lookup.bypass = nocache;
+
+	if(!local && (err = lookup_host(&lookup))) {
+		fprintf(stderr, "%s: Error looking up host: %s\n", argv0, gai_strerror(err));
 		return 1;
 	}
+
+	if(verbose && !local)
+		lookup_report(&lookup);
 	
-	/* Send required information to the server */
+	/* Build the request first, with Fast Open it goes out with the SYN */
 
 	term = getenv("TERM")?:"network";
 	
@@ -317,7 +289,62 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 	
-	if(safewrite(sock, buf[0], bufp[0] - buf[0]) == -1) {
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* On a unix socket, the server asks the kernel who we are */
+
+	if(local) {
+		if(setuid(getuid())) {
+			fprintf(stderr, "%s: Unable to drop privileges: %s\n", argv0, strerror(errno));
+			return 1;
+		}
+
+		sock = connect_unix(host);
+	} else {
+		sock = connect_resv(lookup.ai, timeout, verbose, false, fastopen ? buf[0] : NULL, bufp[0] - buf[0], &sent, &aip, NULL);
+	}
+
+	/* What the cache knew didn't work, ask the resolver again */
+
+	if(sock == -1 && lookup.hit && errno != EADDRINUSE) {
+		lookup_done(&lookup, NULL, 0);
+		lookup_free(&lookup);
+		lookup.bypass = true;
+
+		if(!lookup_host(&lookup))
+			sock = connect_resv(lookup.ai, timeout, verbose, false, fastopen ? buf[0] : NULL, bufp[0] - buf[0], &sent, &aip, NULL);
+		else
+			errno = EHOSTUNREACH;
+	}
+
+	if(sock == -1) {
+		err = errno;
+		fprintf(stderr, "%s: Could not make a connection: %s\n", argv0, err == EADDRINUSE ? "all privileged ports in use" : strerror(err));
+		if(err != EADDRINUSE && !local)
+			lookup_done(&lookup, NULL, 0);
+		return 1;
+	}
+
+	if(!local) {
+		lookup_done(&lookup, aip, elapsed(&start, NULL));
+		lookup_free(&lookup);
+	}
+
+	/* Drop privileges */
+	
+	if(setuid(getuid())) {
+		fprintf(stderr, "%s: Unable to drop privileges: %s\n", argv0, strerror(errno));
+		return 1;
+	}
+	
+	if(tls && (sock = tls_client(sock, host, verbose)) == -1) {
+		fprintf(stderr, "%s: %s\n", argv0, tls_error());
+		return 1;
+	}
+
+	/* Send the rest of the required information to the server */
+
+	if(safewrite(sock, buf[0] + sent, bufp[0] - buf[0] - sent) == -1) {
 		fprintf(stderr, "%s: Unable to send required information: %s\n", argv0, strerror(errno));
 		return 1;
 	}
@@ -419,6 +446,14 @@ int main(int argc, char **argv) {
 		fprintf(stderr, "%s: signal() failed: %s\n", argv0, strerror(errno));
 		return 1;
 	}
+
+	/* There is no urgent data over TLS, but a server that does TLS also
+	   does window sizes */
+
+	if(tls) {
+		winchsupport = true;
+		winch();
+	}
 	
 	for(;;) {
 		errno = 0;
@@ -37,10 +37,17 @@
 #include <grp.h>
 #include <syslog.h>
 
+#include "connect.h"
+#include "tls.h"
+
 static char *argv0;
 
+/* Certificate and key for clients that start with a TLS handshake */
+
+static char *certfile;
+
 static void usage(void) {
-	syslog(LOG_NOTICE, "Usage: %s", argv0);
+	syslog(LOG_NOTICE, "Usage: %s [-c certfile] [-L port]", argv0);
 }
 
 /* Make sure everything gets written */
@@ -183,6 +190,9 @@ int main(int argc, char **argv) {
 	char host[NI_MAXHOST];
 	char addr[NI_MAXHOST];
 	char port[NI_MAXSERV];
+	bool local = false;
+	bool tls = false;
+	int fd;
 	
 	char buf[4096];
 	int len;
@@ -207,8 +217,18 @@ int main(int argc, char **argv) {
 	
 	/* Process options */
 			
-	while((opt = getopt(argc, argv, "+")) != -1) {
+	while((opt = getopt(argc, argv, "+c:L:")) != -1) {
 		switch(opt) {
+			case 'c':
+				if(!tls_server_init(optarg)) {
+					syslog(LOG_ERR, "%s", tls_error());
+					return 1;
+				}
+				certfile = optarg;
+				break;
+			case 'L':
+				serve_standalone(optarg);
+				break;
 			default:
 				syslog(LOG_ERR, "Unknown option!");
 				usage();
@@ -229,34 +249,60 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 	
-	/* Unmap V4MAPPED addresses */
+	/* A client on this host, the kernel tells us who it is, see peer_allowed() */
+
+	if(peer->sa_family == AF_UNIX) {
+		local = true;
+		strcpy(host, "localhost");
+		strcpy(addr, "localhost");
+	} else {
+		/* Unmap V4MAPPED addresses */
 	
-	if(peer->sa_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&((struct sockaddr_in6 *)peer)->sin6_addr)) {
-		((struct sockaddr_in *)peer)->sin_addr.s_addr = ((struct sockaddr_in6 *)peer)->sin6_addr.s6_addr32[3];
-		peer->sa_family = AF_INET;
-	}
+		if(peer->sa_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&((struct sockaddr_in6 *)peer)->sin6_addr)) {
+			((struct sockaddr_in *)peer)->sin_addr.s_addr = ((struct sockaddr_in6 *)peer)->sin6_addr.s6_addr32[3];
+			peer->sa_family = AF_INET;
+		}
 
-	/* Lookup hostname */
+		/* Lookup hostname */
 	
-	if((err = getnameinfo(peer, peerlen, host, sizeof host, NULL, 0, 0))) {
-		syslog(LOG_ERR, "Error resolving address: %s", gai_strerror(err));
-		return 1;
-	}
+		if((err = getnameinfo(peer, peerlen, host, sizeof host, NULL, 0, 0))) {
+			syslog(LOG_ERR, "Error resolving address: %s", gai_strerror(err));
+			return 1;
+		}
 	
-	if((err = getnameinfo(peer, peerlen, addr, sizeof addr, port, sizeof port, NI_NUMERICHOST | NI_NUMERICSERV))) {
-		syslog(LOG_ERR, "Error resolving address: %s", gai_strerror(err));
-		return 1;
-	}
+		if((err = getnameinfo(peer, peerlen, addr, sizeof addr, port, sizeof port, NI_NUMERICHOST | NI_NUMERICSERV))) {
+			syslog(LOG_ERR, "Error resolving address: %s", gai_strerror(err));
+			return 1;
+		}
 	
-	/* Check if connection comes from a privileged port */
+		/* Check if connection comes from a privileged port */
 	
-	portnr = atoi(port);
+		portnr = atoi(port);
 	
-	if(portnr < 512 || portnr >= 1024) {
-		syslog(LOG_ERR, "Connection from %s on illegal port %d.", host, portnr);
-		return 1;
+		if(!RESVPORT(portnr)) {
+			syslog(LOG_ERR, "Connection from %s on illegal port %d.", host, portnr);
+			return 1;
+		}
 	}
 	
+	/* A client that starts with a TLS handshake instead of a request */
+
+	if(certfile && !local && tls_hello(0)) {
+		if((fd = tls_server(0)) == -1) {
+			syslog(LOG_ERR, "TLS with %s failed: %s", host, tls_error());
+			return 1;
+		}
+
+		if(fd != 0) {
+			dup2(fd, 0);
+			dup2(fd, 1);
+			dup2(fd, 2);
+			close(fd);
+		}
+
+		tls = true;
+	}
+
 	/* Wait for NULL byte */
 	
 	if(read(0, buf, 1) != 1 || *buf) {
@@ -275,6 +321,11 @@ int main(int argc, char **argv) {
 		syslog(LOG_ERR, "Error while receiving terminal from %s: %m", host);
 		return 1;
 	}
+
+	if(local && !peer_allowed(0, user)) {
+		syslog(LOG_ERR, "Connection from a local process that is not %s", user);
+		return 1;
+	}
 	
 	syslog(LOG_NOTICE, "Connection from %s@%s for %s", user, host, luser);
 	
@@ -357,16 +408,24 @@ int main(int argc, char **argv) {
 		syslog(LOG_ERR, "PAM_USER does not exist?!");
 		return 1;
 	}
+
+#ifdef TESTMODE
+	/* Don't let the user's shell startup files skew measurements */
+
+	pw->pw_shell = "/bin/sh";
+#endif
 	
 	if (setgid(pw->pw_gid)) {
 		syslog(LOG_ERR, "setgid() failed: %m");
 		return 1;
 	}
 	
+#ifndef TESTMODE
 	if (initgroups(pamuser, pw->pw_gid)) {
 		syslog(LOG_ERR, "initgroups() failed: %m");
 		return 1;
 	}
+#endif
 	
 	err = pam_setcred(handle, PAM_ESTABLISH_CRED);
 	
@@ -384,7 +443,9 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 	
-	if(send(1, "\x80", 1, MSG_OOB) <= 0) {
+	/* Urgent data can't go through TLS, the client knows we do window sizes */
+
+	if(!tls && send(1, "\x80", 1, MSG_OOB) <= 0) {
 		syslog(LOG_ERR, "Unable to write OOB \x80: %m");
 		return 1;
 	}
@@ -500,9 +561,14 @@ int main(int argc, char **argv) {
 		asprintf(&envp[0], "TERM=%s", term);
 		envp[1] = NULL;
 
-		/* Spawn login process */
+		/* Spawn login process. Without root, login can't do its job,
+		   so test builds just run the shell. */
 		
+#ifdef TESTMODE
+		execle(pw->pw_shell, "-sh", NULL, envp);
+#else
 		execle("/bin/login", "login", "-p", "-h", host, "-f", pamuser, NULL, envp);
+#endif
 
 		syslog(LOG_ERR, "Failed to spawn login process: %m");
 		return 1;
@@ -16,134 +16,3355 @@
     Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <stdlib.h>
-#include <pwd.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <sys/poll.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <libgen.h>
+#include <signal.h>
+
+#include "connect.h"
+#include "protocol.h"
+#include "librsh.h"
+#include "tls.h"
 
 #define BUFLEN 0x10000
 
-#ifndef BINDIR
-#define BINDIR "/usr/bin"
-#endif
+#ifndef BINDIR
+#define BINDIR "/usr/bin"
+#endif
+
+static char *argv0;
+
+static void usage(void) {
+	fprintf(stderr, "Usage: %s [-46vnxezTC] [-b[settings]] [-j file] [-l user] [-p port] [-t timeout] [-S socket] [user@]host command...\n", argv0);
+	fprintf(stderr, "       %s [-46vnxas] [-l user] [-p port] [-t timeout] [-F fanout] [-R relays | -E percentile] {-H host,... | -f hostfile}... command...\n", argv0);
+	fprintf(stderr, "       %s [-46vxeTC] [-b[settings]] [-j file] [-l user] [-p port] [-t timeout] {-M socket | [-z] -B file} [user@]host\n", argv0);
+	fprintf(stderr, "       %s [-46vx] [-l user] [-p port] [-t timeout] [-o logfile] -B file {-H host[/slots],... | -f hostfile}...\n", argv0);
+}
+
+/* A number for an option, or -1 if it is not one */
+
+static int number(const char *str) {
+	long value;
+	char *end;
+
+	errno = 0;
+	value = strtol(str, &end, 10);
+
+	if(end == str || *end || errno || value < 0 || value > INT_MAX)
+		return -1;
+
+	return value;
+}
+
+/* Make sure everything gets written */
+
+static ssize_t safewrite(int fd, const void *buf, size_t count) {
+	int written = 0, result;
+	
+	while(count) {
+		result = write(fd, buf, count);
+		if(result == -1) {
+			if(errno == EINTR)
+				continue;
+			else
+				return result;
+		}
+		written += result;
+		buf += result;
+		count -= result;
+	}
+	
+	return written;
+}
+
+static void closestdin(void) {
+	int fd;
+
+	close(0);
+
+	if((fd = open("/dev/null", O_RDONLY)) < 0) {
+		fprintf(stderr, "%s: Error opening /dev/null: %s\n", argv0, strerror(errno));
+		exit(1);
+	}
+
+	if(fd != 0) {
+		dup2(fd, 0);
+		close(fd);
+	}
+}
+
+/* The password for rexec. It is taken from the environment if it is there,
+   so scripts can use it, but the commands we start don't get to see it.
+   Otherwise it is asked for once, and used for every host. */
+
+static char *rexec_password(void) {
+	char *password = getenv("RSH_PASSWORD");
+
+	if(!password)
+		return getpass("Password: ");
+
+	if(!(password = strdup(password)))
+		return NULL;
+
+	unsetenv("RSH_PASSWORD");
+	return password;
+}
+
+/* Timing of the phases of a connection to a single host, and the amount
+   of data that went through each stream, for -v and -j */
+
+enum {
+	PHASE_SETUP,
+	PHASE_RESOLVE,
+	PHASE_BIND,
+	PHASE_CONNECT,
+	PHASE_REQUEST,
+	PHASE_ANSWER,
+	PHASE_STDERR,
+	PHASE_TRANSFER,
+	PHASES,
+};
+
+static const char *const phase_names[PHASES] = {"setup", "resolve", "bind", "connect", "request", "answer", "stderr", "transfer"};
+
+static struct {
+	bool on;
+	bool verbose;
+	char *json;
+	struct timespec start, last;
+	struct timespec wallclock;
+	double at[PHASES], took[PHASES];
+	bool done[PHASES];
+	int next;
+	const char *host, *port;
+	char addr[NI_MAXHOST];
+	unsigned long long bytes[3];
+} timing;
+
+static void phase_done(int phase) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timing.took[phase] = elapsed(&timing.last, &now);
+	timing.at[phase] = elapsed(&timing.start, &now);
+	timing.done[phase] = true;
+	timing.last = now;
+	timing.next = phase + 1;
+}
+
+static double phase_rate(unsigned long long bytes) {
+	return timing.took[PHASE_TRANSFER] > 0 ? bytes * 1e3 / timing.took[PHASE_TRANSFER] : 0;
+}
+
+static void json_string(FILE *f, const char *str) {
+	fputc('"', f);
+
+	for(; *str; str++) {
+		if(*str == '"' || *str == '\\')
+			fprintf(f, "\\%c", *str);
+		else if((unsigned char)*str < 0x20)
+			fprintf(f, "\\u%04x", *str);
+		else
+			fputc(*str, f);
+	}
+
+	fputc('"', f);
+}
+
+/* Write a single line of JSON, with a single write, so many invocations
+   can append to the same file. If rsh() failed early, a setuid rsh is
+   still root, so the file is opened as the user. */
+
+static void report_json(int status) {
+	static const char *const streams[3] = {"stdin", "stdout", "stderr"};
+	uid_t euid = geteuid();
+	char *buf = NULL;
+	size_t size = 0;
+	FILE *f;
+	int fd, i;
+
+	if(!(f = open_memstream(&buf, &size)))
+		return;
+
+	fprintf(f, "{\"host\":");
+	json_string(f, timing.host ? timing.host : "");
+	fprintf(f, ",\"port\":");
+	json_string(f, timing.port);
+	fprintf(f, ",\"address\":");
+	json_string(f, timing.addr);
+	fprintf(f, ",\"time\":%ld.%06ld,\"status\":%d", (long)timing.wallclock.tv_sec, timing.wallclock.tv_nsec / 1000, status);
+
+	if(timing.next < PHASES)
+		fprintf(f, ",\"failed\":\"%s\"", phase_names[timing.next]);
+
+	fprintf(f, ",\"phases\":{");
+	for(i = 0; i < PHASES; i++)
+		if(timing.done[i])
+			fprintf(f, "%s\"%s\":%.3f", i ? "," : "", phase_names[i], timing.took[i]);
+	fprintf(f, "},\"total\":%.3f", elapsed(&timing.start, NULL));
+
+	fprintf(f, ",\"bytes\":{");
+	for(i = 0; i < 3; i++)
+		fprintf(f, "%s\"%s\":%llu", i ? "," : "", streams[i], timing.bytes[i]);
+	fprintf(f, "},\"rates\":{");
+	for(i = 0; i < 3; i++)
+		fprintf(f, "%s\"%s\":%.0f", i ? "," : "", streams[i], phase_rate(timing.bytes[i]));
+	fprintf(f, "}}\n");
+
+	fclose(f);
+
+	if(!strcmp(timing.json, "-")) {
+		fd = 2;
+	} else if(seteuid(getuid())) {
+		fprintf(stderr, "%s: Unable to drop privileges: %s\n", argv0, strerror(errno));
+		fd = -1;
+	} else {
+		if((fd = open(timing.json, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) == -1)
+			fprintf(stderr, "%s: Could not open %s: %s\n", argv0, timing.json, strerror(errno));
+
+		if(seteuid(euid) && fd != -1) {
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	if(fd != -1 && safewrite(fd, buf, size) == -1)
+		fprintf(stderr, "%s: Could not write to %s: %s\n", argv0, timing.json, strerror(errno));
+
+	if(fd > 2)
+		close(fd);
+
+	free(buf);
+}
+
+static void report(int status) {
+	static const char *const streams[3] = {"stdin", "stdout", "stderr"};
+	int i;
+
+	if(!timing.on)
+		return;
+
+	if(timing.verbose) {
+		for(i = 0; i < PHASES; i++)
+			if(timing.done[i])
+				fprintf(stderr, "%s: %-8s took %8.1f ms, done at %8.1f ms\n", argv0, phase_names[i], timing.took[i], timing.at[i]);
+
+		if(timing.next < PHASES)
+			fprintf(stderr, "%s: Failed during %s, after %.1f ms\n", argv0, phase_names[timing.next], elapsed(&timing.start, NULL));
+
+		for(i = 0; i < 3; i++)
+			fprintf(stderr, "%s: %-8s %llu bytes, %.1f MB/s\n", argv0, streams[i], timing.bytes[i], phase_rate(timing.bytes[i]) / 1e6);
+	}
+
+	if(timing.json)
+		report_json(status);
+}
+
+/* A unidirectional stream from one file descriptor to another.
+   Data is kept in a ring buffer, so the input can be read while earlier
+   data is still being written out. Reading stops when the buffer fills up
+   to the high watermark, and resumes once it has drained to the low
+   watermark, so reads and writes are never too small.
+   When the output is a pipe or a regular file, the data is moved with
+   splice() through an internal pipe instead, which then acts as the ring
+   buffer, and never has to be copied into user space.
+   When the input is a regular file or a pipe, no buffer is needed at all:
+   the data is pushed straight to the output with sendfile() or splice()
+   whenever both sides are ready. */
+
+#define HIWAT (BUFLEN - BUFLEN / 8)
+#define LOWAT (BUFLEN / 2)
+
+struct stream {
+	int in, out;
+	bool eof;
+	bool done;
+	bool full;
+	int error;
+	unsigned long long bytes;
+
+	char *buf;
+	int start, len;
+
+	bool splice;
+	int pipe[2];
+
+	enum {DIRECT_NONE, DIRECT_SENDFILE, DIRECT_SPLICE} direct;
+	bool inready, outready;
+};
+
+static void stream_init(struct stream *s, int in, int out, char *buf, bool zerocopy) {
+	struct stat st;
+
+	memset(s, 0, sizeof *s);
+	s->in = in;
+	s->out = out;
+	s->buf = buf;
+	s->pipe[0] = s->pipe[1] = -1;
+
+	if(!zerocopy)
+		return;
+
+	if(!fstat(in, &st)) {
+		if(S_ISREG(st.st_mode)) {
+			s->direct = DIRECT_SENDFILE;
+			return;
+		} else if(S_ISFIFO(st.st_mode)) {
+			/* The pipe is not ours, so it is left at the size it has */
+			s->direct = DIRECT_SPLICE;
+			return;
+		}
+	}
+
+	if(fstat(out, &st) || !(S_ISFIFO(st.st_mode) || S_ISREG(st.st_mode)))
+		return;
+
+	if(pipe(s->pipe))
+		return;
+
+	/* Make sure the pipe can hold as much as the buffer it replaces */
+
+	if(fcntl(s->pipe[1], F_GETPIPE_SZ) < BUFLEN)
+		fcntl(s->pipe[1], F_SETPIPE_SZ, BUFLEN);
+
+	s->splice = true;
+}
+
+static void stream_free(struct stream *s) {
+	if(s->splice) {
+		close(s->pipe[0]);
+		close(s->pipe[1]);
+		s->splice = false;
+	}
+}
+
+/* Stop splicing, and move whatever is left in the pipe into the buffer */
+
+static void stream_nosplice(struct stream *s) {
+	int result = 0;
+
+	if(s->len)
+		result = read(s->pipe[0], s->buf, s->len);
+
+	stream_free(s);
+	s->start = 0;
+	s->len = result > 0 ? result : 0;
+}
+
+/* Apply the high and low watermarks */
+
+static void stream_update(struct stream *s) {
+	if(s->len >= HIWAT)
+		s->full = true;
+	else if(s->len <= LOWAT)
+		s->full = false;
+}
+
+static bool stream_wantread(const struct stream *s) {
+	if(s->direct)
+		return !s->eof && !s->done && !s->inready;
+
+	return !s->eof && !s->done && !s->full;
+}
+
+static bool stream_wantwrite(const struct stream *s) {
+	if(s->direct)
+		return !s->eof && !s->done && !s->outready;
+
+	return s->len && !s->done;
+}
+
+/* Move data from input to output without buffering, once both are ready */
+
+static void stream_direct(struct stream *s) {
+	ssize_t result;
+
+	if(!s->inready || !s->outready)
+		return;
+
+	s->inready = s->outready = false;
+
+	if(s->direct == DIRECT_SENDFILE)
+		result = sendfile(s->out, s->in, NULL, 4 * BUFLEN);
+	else
+		result = splice(s->in, NULL, s->out, NULL, 4 * BUFLEN, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+	if(result > 0) {
+		s->bytes += result;
+		return;
+	}
+
+	if(!result) {
+		s->eof = true;
+	} else if(errno == EINVAL || errno == ENOSYS) {
+		/* Not supported for this combination of file descriptors, fall back to copying */
+		s->direct = DIRECT_NONE;
+	} else if(errno != EINTR && errno != EAGAIN) {
+		s->error = errno;
+		s->done = true;
+	}
+}
+
+static void stream_read(struct stream *s) {
+	ssize_t result;
+	struct iovec iov[2];
+	int end;
+
+	if(s->direct) {
+		s->inready = true;
+		stream_direct(s);
+		return;
+	}
+
+	if(s->splice) {
+		result = splice(s->in, NULL, s->pipe[1], NULL, BUFLEN - s->len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if(result == -1 && errno == EINVAL) {
+			stream_nosplice(s);
+			return;
+		}
+	} else {
+		/* Fill the free space, which might wrap around the end of the buffer */
+
+		if(!s->len)
+			s->start = 0;
+
+		end = s->start + s->len;
+
+		if(end < BUFLEN) {
+			iov[0].iov_base = s->buf + end;
+			iov[0].iov_len = BUFLEN - end;
+			iov[1].iov_base = s->buf;
+			iov[1].iov_len = s->start;
+		} else {
+			iov[0].iov_base = s->buf + end - BUFLEN;
+			iov[0].iov_len = BUFLEN - s->len;
+			iov[1].iov_len = 0;
+		}
+
+		result = readv(s->in, iov, iov[1].iov_len ? 2 : 1);
+	}
+
+	if(result > 0) {
+		s->len += result;
+		stream_update(s);
+	} else if(!result) {
+		s->eof = true;
+	} else if(errno != EINTR && errno != EAGAIN) {
+		s->error = errno;
+		s->eof = true;
+	}
+}
+
+static void stream_write(struct stream *s) {
+	ssize_t result;
+	struct iovec iov[2];
+
+	if(s->direct) {
+		s->outready = true;
+		stream_direct(s);
+		return;
+	}
+
+	if(s->splice) {
+		result = splice(s->pipe[0], NULL, s->out, NULL, s->len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if(result == -1 && errno == EINVAL) {
+			stream_nosplice(s);
+			return;
+		}
+	} else {
+		/* Write out the data, which might wrap around the end of the buffer */
+
+		iov[0].iov_base = s->buf + s->start;
+
+		if(s->start + s->len <= BUFLEN) {
+			iov[0].iov_len = s->len;
+			iov[1].iov_len = 0;
+		} else {
+			iov[0].iov_len = BUFLEN - s->start;
+			iov[1].iov_base = s->buf;
+			iov[1].iov_len = s->len - iov[0].iov_len;
+		}
+
+		result = writev(s->out, iov, iov[1].iov_len ? 2 : 1);
+	}
+
+	if(result > 0) {
+		s->len -= result;
+		s->bytes += result;
+		if(!s->splice)
+			s->start = (s->start + result) % BUFLEN;
+		stream_update(s);
+	} else if(result == -1 && errno != EINTR && errno != EAGAIN) {
+		s->error = errno;
+		s->done = true;
+	}
+}
+
+/* Write out the complete lines in a stream's buffer, each prefixed with a
+   host name, unless the prefix is NULL. A line that doesn't fit in the
+   buffer, or that is not terminated at the end of the stream, is written
+   out as it is.
+   Whatever is left is moved to the start of the buffer, so the contents
+   never wrap around. */
+
+static void stream_writelines(struct stream *s, const char *prefix) {
+	static char out[2 * BUFLEN];
+	char *line = s->buf + s->start, *nl;
+	int left = s->len, outlen = 0, prefixlen = prefix ? strlen(prefix) : 0, n;
+
+	while(left) {
+		if((nl = memchr(line, '\n', left)))
+			n = nl - line + 1;
+		else if(s->eof || left >= HIWAT)
+			n = left;
+		else
+			break;
+
+		if(outlen + prefixlen + n + 3 > sizeof out) {
+			if(safewrite(s->out, out, outlen) == -1)
+				s->error = errno;
+			outlen = 0;
+		}
+
+		if(prefix) {
+			memcpy(out + outlen, prefix, prefixlen);
+			outlen += prefixlen;
+			out[outlen++] = ':';
+			out[outlen++] = ' ';
+		}
+
+		memcpy(out + outlen, line, n);
+		outlen += n;
+		if(!nl)
+			out[outlen++] = '\n';
+
+		line += n;
+		left -= n;
+	}
+
+	if(outlen && safewrite(s->out, out, outlen) == -1)
+		s->error = errno;
+
+	memmove(s->buf, line, left);
+	s->start = 0;
+	s->len = left;
+	stream_update(s);
+}
+
+/* Output of a session that is kept to be shown later, together with that
+   of all other hosts with exactly the same output. It is hashed as it comes
+   in, so identical outputs can be found without having to compare them.
+   Small outputs are kept in memory, larger ones are moved to a temporary
+   file, so the memory used per host stays bounded. */
+
+#define KEEPMAX BUFLEN
+
+struct output {
+	uint64_t hash;
+	size_t len;
+	char last;
+	char *buf;
+	int fd;
+};
+
+static void output_init(struct output *o) {
+	memset(o, 0, sizeof *o);
+	o->hash = 0xcbf29ce484222325ULL;
+	o->fd = -1;
+}
+
+static void output_free(struct output *o) {
+	free(o->buf);
+	o->buf = NULL;
+
+	if(o->fd != -1)
+		close(o->fd);
+	o->fd = -1;
+}
+
+/* Create an anonymous temporary file */
+
+static int tempfile(void) {
+	const char *dir = getenv("TMPDIR");
+	char *name;
+	int fd;
+
+	if(!dir || !*dir)
+		dir = "/tmp";
+
+	if((fd = open(dir, O_TMPFILE | O_RDWR, 0600)) != -1)
+		return fd;
+
+	if(asprintf(&name, "%s/rsh.XXXXXX", dir) == -1)
+		return -1;
+
+	if((fd = mkstemp(name)) != -1)
+		unlink(name);
+
+	free(name);
+	return fd;
+}
+
+static bool output_add(struct output *o, const char *data, size_t len) {
+	char *newbuf;
+	size_t i;
+
+	if(!len)
+		return true;
+
+	/* 64 bit FNV-1a */
+
+	for(i = 0; i < len; i++)
+		o->hash = (o->hash ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+
+	if(o->fd == -1 && o->len + len > KEEPMAX) {
+		if((o->fd = tempfile()) == -1)
+			return false;
+		if(safewrite(o->fd, o->buf, o->len) == -1)
+			return false;
+		free(o->buf);
+		o->buf = NULL;
+	}
+
+	if(o->fd != -1) {
+		if(safewrite(o->fd, data, len) == -1)
+			return false;
+	} else {
+		if(!(newbuf = realloc(o->buf, o->len + len)))
+			return false;
+		o->buf = newbuf;
+		memcpy(o->buf + o->len, data, len);
+	}
+
+	o->len += len;
+	o->last = data[len - 1];
+	return true;
+}
+
+/* Read part of an output, wherever it is kept. Returns how much was read,
+   or -1 if it could not be read. */
+
+static ssize_t output_read(const struct output *o, char *buf, size_t len, off_t off) {
+	ssize_t result;
+
+	if(off >= o->len)
+		return 0;
+
+	if(len > o->len - off)
+		len = o->len - off;
+
+	if(o->fd == -1) {
+		memcpy(buf, o->buf + off, len);
+		return len;
+	}
+
+	while((result = pread(o->fd, buf, len, off)) == -1 && errno == EINTR);
+
+	return result;
+}
+
+/* The hash only tells which outputs can't be the same. A host must never
+   end up under the header of others whose output differs, and the hash is
+   easy to collide on purpose, so outputs with the same hash are compared. */
+
+static bool output_same(const struct output *a, const struct output *b) {
+	char abuf[BUFLEN / 4], bbuf[BUFLEN / 4];
+	ssize_t alen, blen;
+	off_t off = 0;
+
+	if(a->len != b->len || a->hash != b->hash)
+		return false;
+
+	if(a->fd == -1 && b->fd == -1)
+		return !a->len || !memcmp(a->buf, b->buf, a->len);
+
+	while(off < a->len) {
+		alen = output_read(a, abuf, sizeof abuf, off);
+		blen = output_read(b, bbuf, sizeof bbuf, off);
+
+		if(alen <= 0 || alen != blen || memcmp(abuf, bbuf, alen))
+			return false;
+
+		off += alen;
+	}
+
+	return true;
+}
+
+static bool output_write(const struct output *o, int fd) {
+	char buf[BUFLEN];
+	off_t off = 0;
+	ssize_t result;
+
+	if(o->fd == -1)
+		return safewrite(fd, o->buf, o->len) != -1;
+
+	while(off < o->len) {
+		if((result = pread(o->fd, buf, sizeof buf, off)) <= 0) {
+			if(result == -1 && errno == EINTR)
+				continue;
+			return false;
+		}
+
+		if(safewrite(fd, buf, result) == -1)
+			return false;
+
+		off += result;
+	}
+
+	return true;
+}
+
+/* Move everything from a stream's buffer to the output */
+
+static void stream_collect(struct stream *s, struct output *o) {
+	if(!output_add(o, s->buf + s->start, s->len)) {
+		s->error = errno;
+		s->eof = true;
+	}
+
+	s->start = s->len = 0;
+	stream_update(s);
+}
+
+/* Running a command on many hosts at once */
+
+enum state {
+	STATE_QUEUED,
+	STATE_CONNECTING,
+	STATE_WAITING,
+	STATE_ACCEPTING,
+	STATE_RUNNING,
+	STATE_DONE,
+	STATE_FAILED,
+};
+
+#define LATENCY_SAMPLES 32
+
+struct session {
+	char *host;
+	char *user;
+	enum state state;
+	char error[256];
+
+	struct addrinfo *ai;
+	struct connector conn;
+	int sock, lsock, esock;
+	char lport[6];
+
+	struct stream streams[3];
+	char *buf;
+	struct output output[3];
+
+	int pfd, npfd;
+	struct timespec start, end;
+
+	/* Commands run by a child process instead of over a connection: the
+	   command itself on the local host, or rsh relaying it to a group */
+
+	pid_t pid;
+	bool local;
+	struct session *group;
+	int ngroup;
+	int failed;
+
+	/* How far it got with the input */
+
+	off_t inoff;
+	bool indone;
+
+	/* How long it took to answer, now and in earlier runs, see hedge() */
+
+	bool answered;
+	double latency;
+	double history[LATENCY_SAMPLES];
+	int nhistory;
+};
+
+/* Standard input of a fan-out, read once for all hosts. It is kept in a
+   file, and every session sends it from its own offset with sendfile(),
+   so nothing is copied per host, and a slow host only holds up itself.
+   Input from a pipe is spliced into a memory file, or with -s a temporary
+   file on disk, a regular file is sent from directly. Hosts that haven't
+   started yet need the input from the start, after that, what every host
+   has received is thrown away from memory. At most INPUT_MAX bytes are kept
+   there, and reading stops until the slowest host has caught up. */
+
+#define INPUT_MAX (16 << 20)
+#define INPUT_ALIGN (2 << 20)
+
+struct input {
+	int fd;
+	bool own;
+	bool spool;
+	bool eof;
+	off_t start, len;
+	off_t freed;
+};
+
+struct fanout {
+	struct session *sessions;
+	int nsessions;
+	struct session *hosts;
+	int nhosts;
+	int window;
+	int degree;
+	bool relay;
+	char *self;
+	char *command;
+	char *relaycmd;
+	char *luser;
+	char *password;		/* For rexec, see rexec_password() */
+	char *port;
+	int af;
+	int timeout;
+	bool verbose;
+	bool aggregate;
+	int hedge;
+	int argc;
+	char **argv;
+	struct input input;
+};
+
+/* Relays exit with RELAY_FAILED plus the number of their hosts that failed,
+   any other status but 0 means the relay itself failed */
+
+#define RELAY_FAILED 100
+
+/* Binding to privileged ports needs root, so keep the effective uid of the
+   user while running sessions, and only switch back when binding. */
+
+static void privileged(bool on) {
+	/* If this fails, bind() will tell us soon enough */
+	if(seteuid(on ? 0 : getuid()))
+		return;
+}
+
+/* Give up root for good. The effective uid has to be root again first,
+   otherwise setuid() leaves the saved set-user-ID alone, and a later
+   seteuid(0) would get it back. */
+
+static bool drop_privileges(void) {
+	privileged(true);
+
+	if(setuid(getuid())) {
+		fprintf(stderr, "%s: Unable to drop privileges: %s\n", argv0, strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+static bool input_init(struct input *in) {
+	struct stat st;
+
+	if(!fstat(0, &st) && S_ISREG(st.st_mode)) {
+		in->fd = 0;
+		in->start = lseek(0, 0, SEEK_CUR);
+		in->len = st.st_size;
+		in->eof = true;
+
+		if(in->start < 0 || in->start > in->len)
+			in->start = in->len;
+
+		return true;
+	}
+
+	in->fd = in->spool ? tempfile() : memfd_create("rsh-input", MFD_CLOEXEC);
+	in->own = true;
+	return in->fd != -1;
+}
+
+static bool input_wantread(const struct input *in) {
+	return in->own && !in->eof && (in->spool || in->len - in->freed < INPUT_MAX);
+}
+
+static void input_read(struct input *in) {
+	char buf[BUFLEN];
+	ssize_t result;
+	size_t max = 4 * BUFLEN;
+
+	if(!in->spool && INPUT_MAX - (in->len - in->freed) < max)
+		max = INPUT_MAX - (in->len - in->freed);
+
+	result = splice(0, NULL, in->fd, &in->len, max, SPLICE_F_MOVE);
+
+	/* Not a pipe, copy it instead */
+
+	if(result == -1 && errno == EINVAL) {
+		if((result = read(0, buf, max < sizeof buf ? max : sizeof buf)) > 0) {
+			if(pwrite(in->fd, buf, result, in->len) != result)
+				result = -1;
+			else
+				in->len += result;
+		}
+	}
+
+	if(!result) {
+		in->eof = true;
+	} else if(result == -1 && errno != EINTR && errno != EAGAIN) {
+		fprintf(stderr, "%s: Could not read input: %s\n", argv0, strerror(errno));
+		in->eof = true;
+	}
+}
+
+/* Throw away the input before the given offset. Pages sent with sendfile()
+   can still be queued in a socket, or on loopback even in the receiving one.
+   Punching a hole in a memory file only drops our reference to whole pages,
+   so those stay intact as long as we don't cut through a huge page. Disk
+   filesystems may clear them instead, so a spool file is kept whole. */
+
+static void input_release(struct input *in, off_t offset) {
+	offset &= ~(off_t)(INPUT_ALIGN - 1);
+
+	if(!in->own || in->spool || offset <= in->freed)
+		return;
+
+	if(fallocate(in->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, in->freed, offset - in->freed))
+		return;
+
+	in->freed = offset;
+}
+
+static void session_fail(struct session *s, const char *what, int err) {
+	snprintf(s->error, sizeof s->error, "%s%s%s", what, err ? ": " : "", err ? strerror(err) : "");
+	s->state = STATE_FAILED;
+	clock_gettime(CLOCK_MONOTONIC, &s->end);
+
+	connector_free(&s->conn);
+
+	if(s->sock != -1)
+		close(s->sock);
+	if(s->lsock != -1)
+		close(s->lsock);
+	if(s->esock != -1)
+		close(s->esock);
+	if(s->ai)
+		freeaddrinfo(s->ai);
+
+	s->sock = s->lsock = s->esock = -1;
+	s->ai = NULL;
+	free(s->buf);
+	s->buf = NULL;
+
+	/* What the host printed before it failed is still shown, see aggregate() */
+
+	if(s->pid > 0) {
+		kill(s->pid, SIGTERM);
+		waitpid(s->pid, NULL, 0);
+		s->pid = 0;
+	}
+}
+
+/* Split off the port of a host given as host:port or [address]:port.
+   A plain IPv6 address has more than one colon, and no port. */
+
+static const char *host_port(const char *host, char *name, size_t namelen, const char *port) {
+	const char *colon = strchr(host, ':');
+	size_t len = strlen(host);
+
+	if(*host == '[') {
+		host++;
+		len = strcspn(host, "]");
+		if(host[len] == ']' && host[len + 1] == ':')
+			port = host + len + 2;
+	} else if(colon && colon == strrchr(host, ':')) {
+		len = colon - host;
+		port = colon + 1;
+	}
+
+	snprintf(name, namelen, "%.*s", (int)len, host);
+	return port;
+}
+
+/* Run a command in a child process, with standard input from in, and
+   handle its output like that of a remote host */
+
+static void session_spawn(struct session *s, char *const *argv, int in) {
+	int out[2], err[2];
+
+	if(pipe2(out, O_CLOEXEC)) {
+		session_fail(s, "Could not start command", errno);
+		return;
+	}
+
+	if(pipe2(err, O_CLOEXEC)) {
+		close(out[0]);
+		close(out[1]);
+		session_fail(s, "Could not start command", errno);
+		return;
+	}
+
+	s->sock = out[0];
+	s->esock = err[0];
+
+	if(!(s->buf = malloc(2 * BUFLEN)) || (s->pid = fork()) == -1) {
+		close(out[1]);
+		close(err[1]);
+		s->pid = 0;
+		session_fail(s, "Could not start command", errno);
+		return;
+	}
+
+	if(!s->pid) {
+		dup2(in, 0);
+		dup2(out[1], 1);
+		dup2(err[1], 2);
+		closefrom(3);
+
+		/* Give up privileges for good, only a setuid rsh gets them back */
+
+		privileged(true);
+		if(setuid(getuid()))
+			_exit(127);
+
+		execvp(argv[0], argv);
+		fprintf(stderr, "%s: Could not execute %s: %s\n", argv0, argv[0], strerror(errno));
+		_exit(127);
+	}
+
+	close(out[1]);
+	close(err[1]);
+
+	fcntl(s->sock, F_SETFL, fcntl(s->sock, F_GETFL) | O_NONBLOCK);
+	fcntl(s->esock, F_SETFL, fcntl(s->esock, F_GETFL) | O_NONBLOCK);
+
+	stream_init(&s->streams[1], s->sock, 1, s->buf, false);
+	stream_init(&s->streams[2], s->esock, 2, s->buf + BUFLEN, false);
+	s->state = STATE_RUNNING;
+}
+
+/* Run the command on the local host, or start rsh to relay it to a group */
+
+static void session_run(struct fanout *f, struct session *s) {
+	char *argv[16], name[NI_MAXHOST], timeout[32];
+	const char *shell = getenv("SHELL");
+	int argc = 0, in, i;
+
+	if(s->local) {
+		argv[argc++] = shell && *shell ? (char *)shell : "/bin/sh";
+		argv[argc++] = "-c";
+		argv[argc++] = f->command;
+		in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+	} else {
+		argv[argc++] = f->self;
+		argv[argc++] = "-l";
+		argv[argc++] = s->user;
+		argv[argc++] = "-p";
+		argv[argc++] = (char *)host_port(s->host, name, sizeof name, f->port);
+		if(f->af == AF_INET)
+			argv[argc++] = "-4";
+		else if(f->af == AF_INET6)
+			argv[argc++] = "-6";
+		if(f->timeout) {
+			snprintf(timeout, sizeof timeout, "%g", f->timeout / 1e3);
+			argv[argc++] = "-t";
+			argv[argc++] = timeout;
+		}
+		argv[argc++] = name;
+		argv[argc++] = f->relaycmd;
+
+		/* The relay gets the hosts of its group on standard input */
+
+		if((in = tempfile()) != -1) {
+			for(i = 0; i < s->ngroup; i++)
+				dprintf(in, "%s@%s\n", s->group[i].user, s->group[i].host);
+			lseek(in, 0, SEEK_SET);
+		}
+	}
+
+	argv[argc] = NULL;
+
+	if(in == -1) {
+		session_fail(s, "Could not start command", errno);
+		return;
+	}
+
+	session_spawn(s, argv, in);
+	close(in);
+}
+
+static void session_start(struct fanout *f, struct session *s) {
+	struct addrinfo hint;
+	char name[NI_MAXHOST];
+	const char *port;
+	int err;
+
+	clock_gettime(CLOCK_MONOTONIC, &s->start);
+	s->sock = s->lsock = s->esock = -1;
+	s->inoff = f->input.start;
+	s->indone = f->input.fd == -1;
+	output_init(&s->output[1]);
+	output_init(&s->output[2]);
+
+	if(s->local || s->group) {
+		session_run(f, s);
+		return;
+	}
+
+	port = host_port(s->host, name, sizeof name, f->port);
+
+	memset(&hint, '\0', sizeof hint);
+	hint.ai_family = f->af;
+	hint.ai_socktype = SOCK_STREAM;
+
+	if((err = getaddrinfo(name, port, &hint, &s->ai))) {
+		snprintf(s->error, sizeof s->error, "Error looking up host: %s", gai_strerror(err));
+		s->state = STATE_FAILED;
+		clock_gettime(CLOCK_MONOTONIC, &s->end);
+		return;
+	}
+
+	if(!connector_init(&s->conn, s->ai, f->timeout, false)) {
+		session_fail(s, "Could not make a connection", s->conn.error);
+		return;
+	}
+
+	s->conn.anyport = f->password;
+
+	s->state = STATE_CONNECTING;
+}
+
+/* Send a session more of the input, and the end of it once it has it all */
+
+static void session_input(struct fanout *f, struct session *s) {
+	struct input *in = &f->input;
+	ssize_t result;
+
+	if(s->inoff < in->len) {
+		result = sendfile(s->sock, in->fd, &s->inoff, in->len - s->inoff);
+
+		/* The command doesn't want any more */
+
+		if(result == -1 && errno != EINTR && errno != EAGAIN)
+			s->indone = true;
+
+		return;
+	}
+
+	if(in->eof) {
+		shutdown(s->sock, SHUT_WR);
+		s->indone = true;
+	}
+}
+
+static void session_step(struct fanout *f, struct session *s, struct pollfd *pfd) {
+	char buf[BUFLEN];
+	int result, len, status = 0, i;
+
+	switch(s->state) {
+		case STATE_CONNECTING:
+			privileged(true);
+			result = connector_step(&s->conn, pfd);
+
+			if(result == 1) {
+				s->sock = s->conn.sock;
+				s->lsock = listen_stderr(s->conn.winner->ai->ai_family, f->password, s->lport, sizeof s->lport);
+			}
+
+			privileged(false);
+
+			if(!result)
+				return;
+
+			if(result == -1) {
+				session_fail(s, "Could not make a connection", s->conn.error ? s->conn.error : ECONNREFUSED);
+				return;
+			}
+
+			connector_free(&s->conn);
+			freeaddrinfo(s->ai);
+			s->ai = NULL;
+
+			if(s->lsock == -1) {
+				session_fail(s, "Could not create stderr socket", errno);
+				return;
+			}
+
+			if((len = build_request(buf, sizeof buf, s->lport, f->password ? s->user : f->luser, f->password ? f->password : s->user, f->argc, f->argv)) == -1) {
+				session_fail(s, "Arguments too long", 0);
+				return;
+			}
+
+			if(safewrite(s->sock, buf, len) == -1) {
+				session_fail(s, "Unable to send required information", errno);
+				return;
+			}
+
+			s->state = STATE_WAITING;
+			return;
+
+		case STATE_WAITING:
+			if(!pfd->revents)
+				return;
+
+			errno = 0;
+			*buf = 0;
+
+			if(read(s->sock, buf, 1) != 1 || *buf) {
+				session_fail(s, "Didn't receive NULL byte from server", *buf == 1 ? EACCES : errno);
+				return;
+			}
+
+			s->state = STATE_ACCEPTING;
+			return;
+
+		case STATE_ACCEPTING:
+			if(!pfd->revents)
+				return;
+
+			if((s->esock = accept(s->lsock, NULL, 0)) == -1) {
+				session_fail(s, "Could not accept stderr connection", errno);
+				return;
+			}
+
+			close(s->lsock);
+			s->lsock = -1;
+
+			if(!(s->buf = malloc(2 * BUFLEN))) {
+				session_fail(s, "Could not allocate buffers", errno);
+				return;
+			}
+
+			/* Input is sent once the command runs, see session_input() */
+
+			fcntl(s->sock, F_SETFL, fcntl(s->sock, F_GETFL) | O_NONBLOCK);
+			fcntl(s->esock, F_SETFL, fcntl(s->esock, F_GETFL) | O_NONBLOCK);
+
+			stream_init(&s->streams[1], s->sock, 1, s->buf, false);
+			stream_init(&s->streams[2], s->esock, 2, s->buf + BUFLEN, false);
+			s->state = STATE_RUNNING;
+			return;
+
+		case STATE_RUNNING:
+			if(pfd[2].fd != -1 && pfd[2].revents)
+				session_input(f, s);
+
+			for(i = 1; i < 3; i++) {
+				if(pfd[i - 1].fd == -1 || !pfd[i - 1].revents)
+					continue;
+
+				stream_read(&s->streams[i]);
+
+				if(f->aggregate)
+					stream_collect(&s->streams[i], &s->output[i]);
+				else
+					stream_writelines(&s->streams[i], s->group ? NULL : s->host);
+			}
+
+			if(!s->streams[1].eof || !s->streams[2].eof)
+				return;
+
+			for(i = 1; i < 3; i++) {
+				if(s->streams[i].error) {
+					session_fail(s, "Error while relaying output", s->streams[i].error);
+					return;
+				}
+			}
+
+			close(s->sock);
+			close(s->esock);
+			s->sock = s->esock = -1;
+			free(s->buf);
+			s->buf = NULL;
+
+			if(s->pid > 0) {
+				waitpid(s->pid, &status, 0);
+				s->pid = 0;
+			}
+
+			if(s->group && status) {
+				if(!WIFEXITED(status) || WEXITSTATUS(status) <= RELAY_FAILED) {
+					snprintf(buf, sizeof buf, "Relay to %d hosts failed", s->ngroup);
+					session_fail(s, buf, 0);
+					return;
+				}
+
+				s->failed = WEXITSTATUS(status) - RELAY_FAILED;
+			}
+
+			s->state = STATE_DONE;
+			clock_gettime(CLOCK_MONOTONIC, &s->end);
+			return;
+
+		default:
+			return;
+	}
+}
+
+/* Fill in the file descriptors a session waits for, returns the poll() timeout */
+
+static int session_pollfds(struct fanout *f, struct session *s, struct pollfd *pfd) {
+	int i;
+
+	switch(s->state) {
+		case STATE_CONNECTING:
+			s->npfd = s->conn.slots;
+			return connector_pollfds(&s->conn, pfd);
+
+		case STATE_WAITING:
+		case STATE_ACCEPTING:
+			s->npfd = 1;
+			pfd->fd = s->state == STATE_WAITING ? s->sock : s->lsock;
+			pfd->events = POLLIN;
+			pfd->revents = 0;
+			return -1;
+
+		case STATE_RUNNING:
+			s->npfd = 3;
+			for(i = 1; i < 3; i++) {
+				pfd[i - 1].fd = stream_wantread(&s->streams[i]) ? s->streams[i].in : -1;
+				pfd[i - 1].events = POLLIN;
+				pfd[i - 1].revents = 0;
+			}
+			pfd[2].fd = !s->indone && (s->inoff < f->input.len || f->input.eof) ? s->sock : -1;
+			pfd[2].events = POLLOUT;
+			pfd[2].revents = 0;
+			return -1;
+
+		default:
+			s->npfd = 0;
+			return -1;
+	}
+}
+
+/* Show each distinct output once, headed by the hosts that produced it */
+
+static void show_output(int fd, const char *hosts, const struct output *o) {
+	static const char line[] = "----------------\n";
+
+	dprintf(fd, "%s%s\n%s", line, hosts, line);
+
+	if(!output_write(o, fd))
+		fprintf(stderr, "%s: Could not write output: %s\n", argv0, strerror(errno));
+	else if(o->len && o->last != '\n')
+		safewrite(fd, "\n", 1);
+}
+
+static void aggregate(struct fanout *f) {
+	struct session *s, *t;
+	bool *shown;
+	char *hosts;
+	size_t hostslen;
+	FILE *list;
+	int i, j;
+
+	if(!(shown = calloc(f->nsessions, sizeof *shown))) {
+		fprintf(stderr, "%s: Could not allocate memory: %s\n", argv0, strerror(errno));
+		return;
+	}
+
+	for(i = 0; i < f->nsessions; i++) {
+		s = &f->sessions[i];
+
+		if(s->state != STATE_DONE || shown[i])
+			continue;
+
+		if(!(list = open_memstream(&hosts, &hostslen)))
+			break;
+
+		fputs(s->host, list);
+
+		for(j = i + 1; j < f->nsessions; j++) {
+			t = &f->sessions[j];
+
+			if(t->state != STATE_DONE || shown[j])
+				continue;
+
+			if(output_same(&s->output[1], &t->output[1]) && output_same(&s->output[2], &t->output[2])) {
+				fprintf(list, ",%s", t->host);
+				shown[j] = true;
+				output_free(&t->output[1]);
+				output_free(&t->output[2]);
+			}
+		}
+
+		fclose(list);
+
+		show_output(1, hosts, &s->output[1]);
+		if(s->output[2].len)
+			show_output(2, hosts, &s->output[2]);
+
+		free(hosts);
+		output_free(&s->output[1]);
+		output_free(&s->output[2]);
+	}
+
+	free(shown);
+}
+
+/* A host that failed is never grouped with others, but what it printed
+   before it failed is often what tells why, so it gets a group of its own */
+
+static void aggregate_failed(struct session *s) {
+	/* Hosts that never started have no output set up at all */
+
+	if(!s->output[1].len && !s->output[2].len)
+		return;
+
+	if(s->output[1].len)
+		show_output(1, s->host, &s->output[1]);
+	if(s->output[2].len)
+		show_output(2, s->host, &s->output[2]);
+
+	output_free(&s->output[1]);
+	output_free(&s->output[2]);
+}
+
+/* Quote a string for the remote shell */
+
+static void shell_quote(FILE *out, const char *str) {
+	fputc('\'', out);
+
+	for(; *str; str++) {
+		if(*str == '\'')
+			fputs("'\\''", out);
+		else
+			fputc(*str, out);
+	}
+
+	fputc('\'', out);
+}
+
+/* Relaying the command through a tree of hosts. The hosts are split into
+   at most degree groups, and rsh on the first host of each group runs the
+   command there, and relays it to the rest of its group in the same way.
+   No host makes more than a handful of connections, and the depth of the
+   tree only grows with the logarithm of the number of hosts. Relays run
+   the rsh installed on them, and tag the output of their hosts themselves.
+   Where we are installed here says nothing about the other hosts, except
+   in test builds, which all run from the same tree. */
+
+static bool tree(struct fanout *f) {
+	static char self[4096];
+	struct session *sessions, *s;
+	int local = f->relay ? 1 : 0, rest = f->nsessions - local, first = local, len, i;
+	FILE *cmd;
+	size_t cmdlen;
+
+	if(rest <= f->degree)
+		return true;
+
+	if((len = readlink("/proc/self/exe", self, sizeof self - 1)) > 0) {
+		self[len] = 0;
+		f->self = self;
+	} else {
+		f->self = BINDIR "/rsh";
+	}
+
+	if(!(cmd = open_memstream(&f->relaycmd, &cmdlen)))
+		return false;
+
+#ifdef TESTMODE
+	shell_quote(cmd, f->self);
+#else
+	shell_quote(cmd, BINDIR "/rsh");
+#endif
+	fprintf(cmd, " -r -R %d -F %d -p ", f->degree, f->window);
+	shell_quote(cmd, f->port);
+	if(f->af == AF_INET)
+		fputs(" -4", cmd);
+	else if(f->af == AF_INET6)
+		fputs(" -6", cmd);
+	if(f->timeout)
+		fprintf(cmd, " -t %g", f->timeout / 1e3);
+	if(f->verbose)
+		fputs(" -v", cmd);
+	fputs(" -f - -- ", cmd);
+	shell_quote(cmd, f->command);
+
+	if(fclose(cmd) || !(sessions = calloc(local + f->degree, sizeof *sessions)))
+		return false;
+
+	if(local)
+		sessions[0] = f->sessions[0];
+
+	for(i = 0; i < f->degree; i++) {
+		s = &sessions[local + i];
+		len = rest / f->degree + (i < rest % f->degree);
+
+		/* A single host needs no relay */
+
+		if(len == 1) {
+			*s = f->sessions[first];
+		} else {
+			s->group = &f->sessions[first];
+			s->ngroup = len;
+			s->host = s->group->host;
+			s->user = s->group->user;
+		}
+
+		first += len;
+	}
+
+	f->hosts = f->sessions;
+	f->sessions = sessions;
+	f->nsessions = local + f->degree;
+	return true;
+}
+
+/* Throw away the input that all hosts have received. If hosts that haven't
+   started yet keep us from reading more, while all others are waiting for
+   it, give up on those hosts. */
+
+static void input_settle(struct fanout *f, int next) {
+	struct input *in = &f->input;
+	struct session *s;
+	off_t low;
+	bool waiting, queued;
+	int i;
+
+again:
+	low = in->len;
+	waiting = true;
+	queued = false;
+
+	for(i = 0; i < f->nsessions; i++) {
+		s = &f->sessions[i];
+
+		if(s->state == STATE_DONE || s->state == STATE_FAILED)
+			continue;
+
+		if(i >= next) {
+			low = in->start;
+			queued = true;
+			continue;
+		}
+
+		if(s->indone)
+			continue;
+
+		if(s->inoff < low)
+			low = s->inoff;
+
+		if(s->state != STATE_RUNNING || s->inoff < in->len)
+			waiting = false;
+	}
+
+	if(waiting && queued && !in->eof && !input_wantread(in)) {
+		for(i = next; i < f->nsessions; i++) {
+			s = &f->sessions[i];
+
+			if(s->state == STATE_FAILED)
+				continue;
+
+			snprintf(s->error, sizeof s->error, "Input too large to keep in memory, see -s");
+			s->state = STATE_FAILED;
+		}
+
+		goto again;
+	}
+
+	input_release(in, low);
+}
+
+static int fanout(struct fanout *f) {
+	struct session *s;
+	struct pollfd *pfd = NULL, *newpfd;
+	int next = 0, active = 0, failed = 0, npfd, maxpfd = 0, inpfd, timeout, t, i;
+	bool dropped = false;
+
+	privileged(false);
+
+	f->nhosts = f->nsessions;
+
+	if(f->degree && !tree(f)) {
+		fprintf(stderr, "%s: Could not allocate memory: %s\n", argv0, strerror(errno));
+		return 1;
+	}
+
+	/* Relays get their hosts on standard input, so there is none for the command */
+
+	f->input.fd = -1;
+
+	if(!f->degree && !input_init(&f->input)) {
+		fprintf(stderr, "%s: Could not store input: %s\n", argv0, strerror(errno));
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	for(;;) {
+		/* Start new sessions while the window allows it */
+
+		while(active < f->window && next < f->nsessions) {
+			s = &f->sessions[next++];
+
+			if(s->state == STATE_FAILED)
+				continue;
+
+			session_start(f, s);
+			active++;
+		}
+
+		/* Make room for the file descriptors of all active sessions */
+
+		npfd = 0;
+		active = 0;
+
+		for(i = 0; i < next; i++) {
+			s = &f->sessions[i];
+
+			if(s->state == STATE_DONE || s->state == STATE_FAILED)
+				continue;
+
+			active++;
+			npfd += s->state == STATE_CONNECTING ? s->conn.slots : 3;
+		}
+
+		if(npfd + 1 > maxpfd) {
+			if(!(newpfd = realloc(pfd, (npfd + 1) * sizeof *pfd))) {
+				fprintf(stderr, "%s: Could not allocate memory: %s\n", argv0, strerror(errno));
+				return 1;
+			}
+
+			pfd = newpfd;
+			maxpfd = npfd + 1;
+		}
+
+		/* Collect the file descriptors to wait for */
+
+		npfd = 0;
+		timeout = -1;
+
+		for(i = 0; i < next; i++) {
+			s = &f->sessions[i];
+
+			if(s->state == STATE_DONE || s->state == STATE_FAILED)
+				continue;
+
+			s->pfd = npfd;
+			t = session_pollfds(f, s, pfd + npfd);
+			npfd += s->npfd;
+
+			if(t != -1 && (timeout == -1 || t < timeout))
+				timeout = t;
+		}
+
+		/* Read more input while there is room for it */
+
+		inpfd = -1;
+
+		if(f->input.own) {
+			input_settle(f, next);
+
+			if(input_wantread(&f->input)) {
+				inpfd = npfd++;
+				pfd[inpfd].fd = 0;
+				pfd[inpfd].events = POLLIN;
+				pfd[inpfd].revents = 0;
+			}
+		}
+
+		/* Once no more ports need to be bound, drop privileges for good */
+
+		if(!dropped && next == f->nsessions) {
+			for(i = 0; i < next; i++)
+				if(f->sessions[i].state == STATE_CONNECTING)
+					break;
+
+			if(i == next) {
+				if(!drop_privileges())
+					return 1;
+				dropped = true;
+			}
+		}
+
+		if(!active) {
+			if(next == f->nsessions)
+				break;
+			continue;
+		}
+
+		if(poll(pfd, npfd, timeout) == -1) {
+			if(errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: poll() failed: %s\n", argv0, strerror(errno));
+			return 1;
+		}
+
+		if(inpfd != -1 && pfd[inpfd].revents)
+			input_read(&f->input);
+
+		for(i = 0; i < next; i++) {
+			s = &f->sessions[i];
+
+			if(s->state != STATE_DONE && s->state != STATE_FAILED)
+				session_step(f, s, pfd + s->pfd);
+		}
+	}
+
+	free(pfd);
+
+	if(f->aggregate)
+		aggregate(f);
+
+	/* Report how each host fared */
+
+	for(i = 0; i < f->nsessions; i++) {
+		s = &f->sessions[i];
+
+		if(s->state == STATE_FAILED) {
+			failed += s->group ? s->ngroup : 1;
+			fprintf(stderr, "%s: %s: %s\n", argv0, s->host, s->error);
+			if(f->aggregate)
+				aggregate_failed(s);
+			continue;
+		}
+
+		failed += s->failed;
+
+		if(f->verbose && s->group)
+			fprintf(stderr, "%s: %s: relayed to %d hosts in %.1f ms\n", argv0, s->host, s->ngroup, elapsed(&s->start, &s->end));
+		else if(f->verbose)
+			fprintf(stderr, "%s: %s: done in %.1f ms\n", argv0, s->host, elapsed(&s->start, &s->end));
+	}
+
+	if(f->relay)
+		return failed ? RELAY_FAILED + (failed < 99 ? failed : 99) : 0;
+
+	if(f->verbose || failed)
+		fprintf(stderr, "%s: %d hosts, %d failed\n", argv0, f->nhosts, failed);
+
+	return failed ? 1 : 0;
+}
+
+/* Hedged execution: the command only has to run on one of the hosts, which
+   are replicas of each other. It starts on the first host, and whenever the
+   newest session fails, or doesn't answer within the given percentile of
+   how long that host took to answer in earlier runs, on the next one as
+   well. The first session to complete wins, the others are torn down.
+   Output is kept until then, so only that of the winner is shown.
+
+   The time until the first output of every host is kept in ~/.rsh_latency,
+   one line per host with its last LATENCY_SAMPLES times in milliseconds.
+   Hosts that were torn down before they answered add nothing: all we know
+   is that they took longer than the delay, and recording that would only
+   push the delay up further every time. */
+
+#define LATENCY_FILE ".rsh_latency"
+#define LATENCY_MIN 4
+#define HEDGE_DELAY 100
+
+static char *latency_path(void) {
+	const char *home = getenv("HOME");
+	char *path;
+
+	if(!home || !*home || asprintf(&path, "%s/" LATENCY_FILE, home) == -1)
+		return NULL;
+
+	return path;
+}
+
+static void latency_load(struct fanout *f) {
+	char *path = latency_path(), *line = NULL, *host, *sample, *end;
+	size_t size = 0;
+	struct session *s;
+	FILE *file;
+	int i;
+
+	if(!path || !(file = fopen(path, "r"))) {
+		free(path);
+		return;
+	}
+
+	while(getline(&line, &size, file) != -1) {
+		if(!(host = strtok(line, " \t\n")))
+			continue;
+
+		for(i = 0; i < f->nsessions && strcmp(f->sessions[i].host, host); i++);
+
+		if(i == f->nsessions)
+			continue;
+
+		s = &f->sessions[i];
+
+		while((sample = strtok(NULL, " \t\n")) && s->nhistory < LATENCY_SAMPLES) {
+			s->history[s->nhistory] = strtod(sample, &end);
+			if(!*end && s->history[s->nhistory] >= 0)
+				s->nhistory++;
+		}
+	}
+
+	free(line);
+	fclose(file);
+	free(path);
+}
+
+/* Write the file again, with the new times added to the hosts they belong to */
+
+static void latency_save(struct fanout *f) {
+	char *path = latency_path(), *tmp = NULL, *line = NULL, *host;
+	size_t size = 0, len;
+	struct session *s;
+	FILE *in, *out;
+	int i, j, first;
+
+	if(!path || asprintf(&tmp, "%s.%d", path, (int)getpid()) == -1 || !(out = fopen(tmp, "w"))) {
+		free(path);
+		free(tmp);
+		return;
+	}
+
+	if((in = fopen(path, "r"))) {
+		while(getline(&line, &size, in) != -1) {
+			len = strcspn(line, " \t\n");
+			host = line;
+
+			for(i = 0; i < f->nsessions; i++)
+				if(f->sessions[i].answered && strlen(f->sessions[i].host) == len && !strncmp(f->sessions[i].host, host, len))
+					break;
+
+			if(i == f->nsessions)
+				fputs(line, out);
+		}
+
+		free(line);
+		fclose(in);
+	}
+
+	for(i = 0; i < f->nsessions; i++) {
+		s = &f->sessions[i];
+
+		if(!s->answered)
+			continue;
+
+		first = s->nhistory == LATENCY_SAMPLES ? 1 : 0;
+		fputs(s->host, out);
+		for(j = first; j < s->nhistory; j++)
+			fprintf(out, " %.1f", s->history[j]);
+		fprintf(out, " %.1f\n", s->latency);
+	}
+
+	if(fclose(out) || rename(tmp, path))
+		unlink(tmp);
+
+	free(tmp);
+	free(path);
+}
+
+static int compare_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* How long to give a host to answer before starting the next one, in ms */
+
+static int hedge_delay(const struct fanout *f, const struct session *s) {
+	double sorted[LATENCY_SAMPLES];
+	int i;
+
+	if(s->nhistory < LATENCY_MIN)
+		return HEDGE_DELAY;
+
+	memcpy(sorted, s->history, s->nhistory * sizeof *sorted);
+	qsort(sorted, s->nhistory, sizeof *sorted, compare_double);
+	i = (s->nhistory * f->hedge + 99) / 100 - 1;
+
+	return sorted[i < 0 ? 0 : i] + 1;
+}
+
+static int hedge(struct fanout *f) {
+	struct session *s, *winner = NULL;
+	struct pollfd *pfd = NULL, *newpfd;
+	struct timespec now, deadline;
+	int next = 0, active, npfd, maxpfd = 0, inpfd, timeout, t, i;
+	bool dropped = false, answered = false;
+
+	privileged(false);
+	latency_load(f);
+
+	f->input.fd = -1;
+
+	if(!input_init(&f->input)) {
+		fprintf(stderr, "%s: Could not store input: %s\n", argv0, strerror(errno));
+		return 1;
+	}
+
+	/* Keep the output until we know which session wins */
+
+	f->aggregate = true;
+	signal(SIGPIPE, SIG_IGN);
+
+	for(;;) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		/* Start the next host if the newest one failed, or is too slow */
+
+		while(next < f->nsessions && !winner && (!next || f->sessions[next - 1].state == STATE_FAILED || (!answered && elapsed(&deadline, &now) >= 0))) {
+			s = &f->sessions[next++];
+			session_start(f, s);
+
+			deadline = now;
+			deadline.tv_nsec += hedge_delay(f, s) * 1000000L;
+			deadline.tv_sec += deadline.tv_nsec / 1000000000;
+			deadline.tv_nsec %= 1000000000;
+
+			if(f->verbose && next > 1)
+				fprintf(stderr, "%s: %s: started after %.1f ms\n", argv0, s->host, elapsed(&f->sessions[0].start, &now));
+		}
+
+		npfd = 0;
+		active = 0;
+
+		for(i = 0; i < next; i++) {
+			s = &f->sessions[i];
+
+			if(s->state == STATE_DONE || s->state == STATE_FAILED)
+				continue;
+
+			active++;
+			npfd += s->state == STATE_CONNECTING ? s->conn.slots : 3;
+		}
+
+		if(winner || !active)
+			break;
+
+		if(npfd + 1 > maxpfd) {
+			if(!(newpfd = realloc(pfd, (npfd + 1) * sizeof *pfd))) {
+				fprintf(stderr, "%s: Could not allocate memory: %s\n", argv0, strerror(errno));
+				return 1;
+			}
+
+			pfd = newpfd;
+			maxpfd = npfd + 1;
+		}
+
+		npfd = 0;
+		timeout = -1;
+
+		if(next < f->nsessions && !answered)
+			timeout = -elapsed(&deadline, &now) + 1;
+
+		for(i = 0; i < next; i++) {
+			s = &f->sessions[i];
+
+			if(s->state == STATE_DONE || s->state == STATE_FAILED)
+				continue;
+
+			s->pfd = npfd;
+			t = session_pollfds(f, s, pfd + npfd);
+			npfd += s->npfd;
+
+			if(t != -1 && (timeout == -1 || t < timeout))
+				timeout = t;
+		}
+
+		inpfd = -1;
+
+		if(f->input.own) {
+			input_settle(f, next);
+
+			if(input_wantread(&f->input)) {
+				inpfd = npfd++;
+				pfd[inpfd].fd = 0;
+				pfd[inpfd].events = POLLIN;
+				pfd[inpfd].revents = 0;
+			}
+		}
+
+		/* Once no more ports need to be bound, drop privileges for good */
+
+		if(!dropped && next == f->nsessions) {
+			for(i = 0; i < next; i++)
+				if(f->sessions[i].state == STATE_CONNECTING)
+					break;
+
+			if(i == next) {
+				if(!drop_privileges())
+					return 1;
+				dropped = true;
+			}
+		}
+
+		if(poll(pfd, npfd, timeout) == -1) {
+			if(errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: poll() failed: %s\n", argv0, strerror(errno));
+			return 1;
+		}
+
+		if(inpfd != -1 && pfd[inpfd].revents)
+			input_read(&f->input);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		for(i = 0; i < next; i++) {
+			s = &f->sessions[i];
+
+			if(s->state == STATE_DONE || s->state == STATE_FAILED)
+				continue;
+
+			session_step(f, s, pfd + s->pfd);
+
+			if(!s->answered && (s->output[1].len || s->output[2].len || s->state == STATE_DONE)) {
+				s->answered = answered = true;
+				s->latency = elapsed(&s->start, &now);
+			}
+
+			if(s->state == STATE_DONE && !winner)
+				winner = s;
+		}
+	}
+
+	free(pfd);
+
+	for(i = 0; i < next; i++) {
+		s = &f->sessions[i];
+
+		if(s->state == STATE_FAILED && (f->verbose || !winner))
+			fprintf(stderr, "%s: %s: %s\n", argv0, s->host, s->error);
+	}
+
+	/* Tear down the others */
+
+	for(i = 0; i < next; i++) {
+		s = &f->sessions[i];
+
+		if(s != winner && s->state != STATE_FAILED)
+			session_fail(s, "Cancelled", 0);
+
+		if(s != winner) {
+			output_free(&s->output[1]);
+			output_free(&s->output[2]);
+		}
+	}
+
+	latency_save(f);
+
+	if(!winner) {
+		fprintf(stderr, "%s: No host could run the command\n", argv0);
+		return 1;
+	}
+
+	if(f->verbose)
+		fprintf(stderr, "%s: %s: answered after %.1f ms, done in %.1f ms\n", argv0, winner->host, winner->latency, elapsed(&winner->start, &winner->end));
+
+	if(!output_write(&winner->output[1], 1) || !output_write(&winner->output[2], 2))
+		return 1;
+
+	output_free(&winner->output[1]);
+	output_free(&winner->output[2]);
+	return 0;
+}
+
+/* Add hosts from a comma separated list */
+
+static bool addhosts(struct fanout *f, char *list) {
+	struct session *sessions;
+	char *host;
+
+	for(host = strtok(list, ", \t\n"); host; host = strtok(NULL, ", \t\n")) {
+		if(*host == '#')
+			break;
+
+		if(!(sessions = realloc(f->sessions, (f->nsessions + 1) * sizeof *sessions)))
+			return false;
+
+		f->sessions = sessions;
+		memset(&f->sessions[f->nsessions], 0, sizeof *sessions);
+		f->sessions[f->nsessions++].host = strdup(host);
+	}
+
+	return true;
+}
+
+/* Add hosts from a file, one per line. This happens while the options are
+   parsed, when a setuid rsh is still root, so the file is opened as the
+   user, who may only give files they can read themselves. */
+
+static bool addhostfile(struct fanout *f, const char *filename) {
+	uid_t euid = geteuid();
+	FILE *file;
+	char line[1024];
+
+	if(!strcmp(filename, "-")) {
+		file = stdin;
+	} else {
+		if(seteuid(getuid()))
+			return false;
+
+		file = fopen(filename, "r");
+
+		if(seteuid(euid) || !file) {
+			if(file)
+				fclose(file);
+			return false;
+		}
+	}
+
+	while(fgets(line, sizeof line, file))
+		if(!addhosts(f, line))
+			return false;
+
+	if(file != stdin)
+		fclose(file);
+
+	return true;
+}
+
+/* Run a command over a connection that uses framing, on channel 0. If a
+   command is given, it is sent first, otherwise the server already has it.
+   Input is read from fd, or if that is -1, the command gets no input.
+   Returns the exit status of the command, or -1 if the connection was lost. */
+
+static struct codec codec;
+
+/* Show how well compression worked */
+
+static void codec_report(void) {
+	if(!codec.on)
+		return;
+
+	fprintf(stderr, "%s: Sent %llu bytes as %llu, received %llu bytes as %llu\n", argv0, codec.rawout, codec.wireout, codec.rawin, codec.wirein);
+}
+
+static int relay_frames(int sock, const char *command, int fd) {
+	static struct framebuf in, out;
+	struct pollfd pfd[2];
+	struct frame f;
+	bool eof = fd == -1;
+	char *data;
+	int result, len, one = 1;
+
+	if(command && !frame_put(&out, FRAME_EXEC, 0, command, strlen(command))) {
+		fprintf(stderr, "%s: Arguments too long!\n", argv0);
+		return -1;
+	}
+
+	if(eof)
+		frame_put(&out, FRAME_STDIN, 0, NULL, 0);
+
+	/* Frames are already collected in a buffer, don't delay them any further */
+
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+	for(;;) {
+		while((result = frame_peek(&in, &f)) == 1) {
+			switch(f.type & ~FRAME_DEFLATE) {
+				case FRAME_READY:
+					break;
+
+				case FRAME_STDOUT:
+				case FRAME_STDERR:
+					if((len = frame_data(&codec, &f, &data)) == -1) {
+						fprintf(stderr, "%s: Invalid compressed data\n", argv0);
+						return -1;
+					}
+
+					if(len && safewrite(f.type == FRAME_STDOUT ? 1 : 2, data, len) == -1) {
+						fprintf(stderr, "%s: %s\n", argv0, strerror(errno));
+						return -1;
+					}
+
+					timing.bytes[f.type == FRAME_STDOUT ? 1 : 2] += len;
+					break;
+
+				case FRAME_EXIT:
+					result = f.len ? (unsigned char)*f.data : 1;
+					frame_next(&in, &f);
+					return result;
+
+				default:
+					fprintf(stderr, "%s: Unexpected frame type %d\n", argv0, f.type);
+					return -1;
+			}
+
+			frame_next(&in, &f);
+		}
+
+		if(result == -1) {
+			fprintf(stderr, "%s: %s\n", argv0, strerror(errno));
+			return -1;
+		}
+
+		pfd[0].fd = !eof && frame_canput(&out, &codec) ? fd : -1;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = sock;
+		pfd[1].events = POLLIN | (out.len ? POLLOUT : 0);
+
+		if(poll(pfd, 2, -1) == -1) {
+			if(errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: poll() failed: %s\n", argv0, strerror(errno));
+			return -1;
+		}
+
+		if(pfd[0].revents && codec.on) {
+			result = read(fd, codec.buf, CODEC_MAX);
+
+			if(result > 0) {
+				timing.bytes[0] += result;
+				frame_put_data(&out, &codec, FRAME_STDIN, 0, codec.buf, result);
+			} else if(!result || (errno != EINTR && errno != EAGAIN)) {
+				frame_put(&out, FRAME_STDIN, 0, NULL, 0);
+				eof = true;
+			}
+		} else if(pfd[0].revents && (data = frame_reserve(&out, &len))) {
+			result = read(fd, data, len);
+
+			if(result > 0) {
+				timing.bytes[0] += result;
+				frame_commit(&out, FRAME_STDIN, 0, result);
+			} else if(!result || (errno != EINTR && errno != EAGAIN)) {
+				frame_commit(&out, FRAME_STDIN, 0, 0);
+				eof = true;
+			}
+		}
+
+		if(pfd[1].revents & POLLOUT) {
+			if(framebuf_write(sock, &out) == -1 && errno != EINTR && errno != EAGAIN)
+				return -1;
+		}
+
+		if(pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+			result = framebuf_read(sock, &in);
+
+			if(!result || (result == -1 && errno != EINTR && errno != EAGAIN))
+				return -1;
+		}
+	}
+}
+
+/* Sharing a session with a server between many invocations of rsh.
+   The master keeps the connection to the server open, and listens on a unix
+   socket. Clients connecting to it send frames just like they would to the
+   server, for channel 0. The master forwards those to the server on a free
+   channel, and the frames for that channel back to the client. If a client
+   can't keep up with its output, the master stops reading from the server
+   until it does. */
+
+struct client {
+	int fd;
+	int chan;
+	bool gone;
+	bool exited;
+	bool ineof;
+	struct framebuf in, out;
+};
+
+static const char *master_path;
+
+static void master_cleanup(int sig) {
+	unlink(master_path);
+	_exit(1);
+}
+
+static int master_listen(const char *path) {
+	struct sockaddr_un sun;
+	mode_t mask;
+	int lsock, sock, result;
+
+	if(strlen(path) >= sizeof sun.sun_path) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	if((lsock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+		return -1;
+
+	mask = umask(077);
+	result = bind(lsock, (struct sockaddr *)&sun, sizeof sun);
+
+	/* Remove a socket left behind by a master that is gone */
+
+	if(result && errno == EADDRINUSE && (sock = socket(AF_UNIX, SOCK_STREAM, 0)) != -1) {
+		if(connect(sock, (struct sockaddr *)&sun, sizeof sun) && errno == ECONNREFUSED && !unlink(path))
+			result = bind(lsock, (struct sockaddr *)&sun, sizeof sun);
+		else
+			errno = EADDRINUSE;
+		close(sock);
+	}
+
+	umask(mask);
+
+	if(result || listen(lsock, 64)) {
+		close(lsock);
+		return -1;
+	}
+
+	return lsock;
+}
+
+/* Connect to a master, returns -1 if there is none. A setuid rsh is still
+   root here, in case there is no master and it has to connect by itself,
+   so connect as the user, or the master would see root on the other end,
+   and any socket would do. */
+
+static int master_connect(const char *path) {
+	uid_t euid = geteuid();
+	struct sockaddr_un sun;
+	int sock, result;
+
+	if(strlen(path) >= sizeof sun.sun_path)
+		return -1;
+
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	if((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+		return -1;
+
+	if(seteuid(getuid())) {
+		close(sock);
+		return -1;
+	}
+
+	result = connect(sock, (struct sockaddr *)&sun, sizeof sun);
+
+	if(seteuid(euid) || result) {
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+static void master_accept(int lsock, struct client ***clients, int *nclients) {
+	struct client *c, **newclients;
+	struct ucred cred;
+	socklen_t len = sizeof cred;
+	int fd;
+
+	if((fd = accept4(lsock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1)
+		return;
+
+	/* Only the user that started the master may use it */
+
+	if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) || (cred.uid != getuid() && cred.uid != 0)) {
+		close(fd);
+		return;
+	}
+
+	if(!(c = calloc(1, sizeof *c)) || !(newclients = realloc(*clients, (*nclients + 1) * sizeof *newclients))) {
+		free(c);
+		close(fd);
+		return;
+	}
+
+	c->fd = fd;
+	c->chan = -1;
+	newclients[(*nclients)++] = c;
+	*clients = newclients;
+}
+
+/* Forward frames from a client to the server */
+
+static void master_fromclient(struct client *c, struct client **channels, struct framebuf *out) {
+	static const char busy[] = "Too many sessions\n";
+	struct frame f;
+	int chan;
+
+	while(!c->gone && frame_peek(&c->in, &f) == 1) {
+		if(f.type == FRAME_EXEC && c->chan == -1) {
+			for(chan = 0; chan < CHANNELS && channels[chan]; chan++);
+
+			if(chan == CHANNELS) {
+				frame_put(&c->out, FRAME_STDERR, 0, busy, sizeof busy - 1);
+				frame_put(&c->out, FRAME_EXIT, 0, "\001", 1);
+				c->exited = true;
+				return;
+			}
+
+			if(!frame_put(out, FRAME_EXEC, chan, f.data, f.len))
+				return;
+
+			channels[chan] = c;
+			c->chan = chan;
+		} else if(f.type == FRAME_STDIN && c->chan != -1 && !c->ineof) {
+			if(!frame_put(out, FRAME_STDIN, c->chan, f.data, f.len))
+				return;
+
+			c->ineof = !f.len;
+		} else {
+			c->gone = true;
+			return;
+		}
+
+		frame_next(&c->in, &f);
+	}
+}
+
+/* Forward frames from the server to the clients. Returns false on a protocol error. */
+
+static bool master_fromserver(struct framebuf *in, struct client **channels) {
+	struct frame f;
+	struct client *c;
+	int result;
+
+	while((result = frame_peek(in, &f)) == 1) {
+		if(f.type != FRAME_STDOUT && f.type != FRAME_STDERR && f.type != FRAME_EXIT)
+			return false;
+
+		if((c = channels[f.chan])) {
+			if(!c->gone && !frame_put(&c->out, f.type, 0, f.data, f.len))
+				return true;
+
+			if(f.type == FRAME_EXIT) {
+				channels[f.chan] = NULL;
+				c->exited = true;
+			}
+		}
+
+		frame_next(in, &f);
+	}
+
+	return result != -1;
+}
+
+static int master(int sock, const char *path, bool verbose) {
+	static struct framebuf in, out;
+	struct client **clients = NULL, *channels[CHANNELS] = {NULL}, *c;
+	struct pollfd *pfd = NULL, *newpfd;
+	struct frame f;
+	int lsock, nclients = 0, npfd, result, one = 1, i, j;
+
+	/* Wait until the server has authenticated us */
+
+	for(;;) {
+		if((result = frame_peek(&in, &f)) == 1) {
+			if(f.type == FRAME_READY) {
+				frame_next(&in, &f);
+				break;
+			}
+
+			if(f.type == FRAME_STDERR)
+				safewrite(2, f.data, f.len);
+
+			frame_next(&in, &f);
+			continue;
+		}
+
+		if(result == -1 || framebuf_read(sock, &in) <= 0) {
+			fprintf(stderr, "%s: Server closed the connection\n", argv0);
+			return 1;
+		}
+	}
+
+	if((lsock = master_listen(path)) == -1) {
+		fprintf(stderr, "%s: Could not listen on %s: %s\n", argv0, path, strerror(errno));
+		return 1;
+	}
+
+	master_path = path;
+	signal(SIGINT, master_cleanup);
+	signal(SIGTERM, master_cleanup);
+	signal(SIGHUP, master_cleanup);
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Go into the background once we are ready for clients */
+
+	switch(fork()) {
+		case -1:
+			fprintf(stderr, "%s: fork() failed: %s\n", argv0, strerror(errno));
+			unlink(path);
+			return 1;
+		case 0:
+			break;
+		default:
+			if(verbose)
+				fprintf(stderr, "%s: Master listening on %s\n", argv0, path);
+			return 0;
+	}
+
+	setsid();
+	closestdin();
+	dup2(0, 1);
+
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	fcntl(lsock, F_SETFL, fcntl(lsock, F_GETFL) | O_NONBLOCK);
+
+	for(;;) {
+		/* Move frames along as far as the buffers allow */
+
+		if(!master_fromserver(&in, channels)) {
+			fprintf(stderr, "%s: Protocol error from server\n", argv0);
+			break;
+		}
+
+		for(i = 0; i < nclients; i++)
+			master_fromclient(clients[i], channels, &out);
+
+		/* Forget about clients that are done, or that went away */
+
+		for(i = j = 0; i < nclients; i++) {
+			c = clients[i];
+
+			if(c->gone && c->chan != -1 && channels[c->chan] == c && !c->ineof && frame_put(&out, FRAME_STDIN, c->chan, NULL, 0))
+				c->ineof = true;
+
+			if((c->exited && !c->out.len) || (c->gone && (c->chan == -1 || channels[c->chan] != c))) {
+				close(c->fd);
+				free(c);
+				continue;
+			}
+
+			clients[j++] = c;
+		}
+
+		nclients = j;
+
+		if(!(newpfd = realloc(pfd, (nclients + 2) * sizeof *pfd))) {
+			fprintf(stderr, "%s: Could not allocate memory: %s\n", argv0, strerror(errno));
+			break;
+		}
+
+		pfd = newpfd;
+
+		pfd[0].fd = sock;
+		pfd[0].events = (framebuf_room(&in) ? POLLIN : 0) | (out.len ? POLLOUT : 0);
+		pfd[1].fd = lsock;
+		pfd[1].events = POLLIN;
+		npfd = 2;
+
+		for(i = 0; i < nclients; i++, npfd++) {
+			c = clients[i];
+			pfd[npfd].fd = c->gone ? -1 : c->fd;
+			pfd[npfd].events = (framebuf_room(&c->in) ? POLLIN : 0) | (c->out.len ? POLLOUT : 0);
+		}
+
+		if(poll(pfd, npfd, -1) == -1) {
+			if(errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: poll() failed: %s\n", argv0, strerror(errno));
+			break;
+		}
+
+		if(pfd[0].revents & POLLOUT) {
+			if(framebuf_write(sock, &out) == -1 && errno != EINTR && errno != EAGAIN)
+				break;
+		}
+
+		if(pfd[0].events & POLLIN && pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+			result = framebuf_read(sock, &in);
+
+			if(!result || (result == -1 && errno != EINTR && errno != EAGAIN))
+				break;
+		}
+
+		for(i = 0; i < nclients; i++) {
+			c = clients[i];
+
+			if(!pfd[i + 2].revents)
+				continue;
+
+			if(pfd[i + 2].revents & POLLOUT) {
+				if(framebuf_write(c->fd, &c->out) == -1 && errno != EINTR && errno != EAGAIN)
+					c->gone = true;
+			}
+
+			if(pfd[i + 2].events & POLLIN && pfd[i + 2].revents & (POLLIN | POLLHUP | POLLERR)) {
+				result = framebuf_read(c->fd, &c->in);
+
+				if(!result || (result == -1 && errno != EINTR && errno != EAGAIN))
+					c->gone = true;
+			}
+		}
+
+		if(pfd[1].revents)
+			master_accept(lsock, &clients, &nclients);
+	}
+
+	/* The connection to the server is gone, and with it all sessions */
+
+	unlink(path);
+
+	for(i = 0; i < nclients; i++)
+		close(clients[i]->fd);
+
+	return 1;
+}
+
+/* Run commands from a file one after another, in a single session.
+   They all use channel 0, the server only starts the next one when the
+   previous one has exited, so we can send commands ahead without waiting
+   for the results of the previous ones.
+   Returns the exit status of the last command, or 1 if the session broke. */
+
+#define BATCH_AHEAD 64
+
+static int batch(int sock, const char *filename, bool verbose) {
+	static struct framebuf in, out;
+	char *commands[BATCH_AHEAD];
+	struct pollfd pfd;
+	struct frame f;
+	FILE *file;
+	char *line = NULL, *command;
+	size_t size = 0;
+	ssize_t len;
+	struct timespec start, end;
+	bool eof = false;
+	char *data;
+	int status = 0, sent = 0, done = 0, result;
+
+	if(!strcmp(filename, "-"))
+		file = stdin;
+	else if(!(file = fopen(filename, "r"))) {
+		fprintf(stderr, "%s: Could not open %s: %s\n", argv0, filename, strerror(errno));
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+	for(;;) {
+		/* Send commands ahead while there is room */
+
+		while(!eof && sent - done < BATCH_AHEAD && framebuf_room(&out) >= 2 * FRAME_HDR + FRAME_MAX) {
+			if((len = getline(&line, &size, file)) == -1) {
+				eof = true;
+				break;
+			}
+
+			if(len && line[len - 1] == '\n')
+				line[--len] = 0;
+
+			for(command = line; *command == ' ' || *command == '\t'; command++);
+
+			if(!*command || *command == '#')
+				continue;
+
+			if(!frame_put(&out, FRAME_EXEC, 0, command, strlen(command))) {
+				fprintf(stderr, "%s: Command too long: %.40s...\n", argv0, command);
+				status = 1;
+				continue;
+			}
+
+			frame_put(&out, FRAME_STDIN, 0, NULL, 0);
+			commands[sent++ % BATCH_AHEAD] = strdup(command);
+		}
+
+		if(eof && done == sent && !out.len)
+			break;
 
-static char *argv0;
+		/* Handle the results */
 
-static void usage(void) {
-	fprintf(stderr, "Usage: %s [-46vn] [-l user] [-p port] [user@]host command...\n", argv0);
-}
+		while((result = frame_peek(&in, &f)) == 1) {
+			if((f.type & ~FRAME_DEFLATE) == FRAME_STDOUT || (f.type & ~FRAME_DEFLATE) == FRAME_STDERR) {
+				if((len = frame_data(&codec, &f, &data)) == -1) {
+					fprintf(stderr, "%s: Invalid compressed data\n", argv0);
+					return 1;
+				}
 
-/* Make sure everything gets written */
+				if(len && safewrite(f.type == FRAME_STDOUT ? 1 : 2, data, len) == -1) {
+					fprintf(stderr, "%s: %s\n", argv0, strerror(errno));
+					return 1;
+				}
+
+				timing.bytes[f.type == FRAME_STDOUT ? 1 : 2] += len;
+			} else if(f.type == FRAME_EXIT && done < sent) {
+				status = f.len ? (unsigned char)*f.data : 1;
+				command = commands[done++ % BATCH_AHEAD];
+				if(status)
+					fprintf(stderr, "%s: Command %d exited with status %d: %s\n", argv0, done, status, command ? command : "");
+				free(command);
+			} else if(f.type != FRAME_READY) {
+				fprintf(stderr, "%s: Unexpected frame type %d\n", argv0, f.type);
+				return 1;
+			}
+
+			frame_next(&in, &f);
+		}
 
-static ssize_t safewrite(int fd, const void *buf, size_t count) {
-	int written = 0, result;
-	
-	while(count) {
-		result = write(fd, buf, count);
 		if(result == -1) {
+			fprintf(stderr, "%s: %s\n", argv0, strerror(errno));
+			return 1;
+		}
+
+		if(eof && done == sent && !out.len)
+			break;
+
+		pfd.fd = sock;
+		pfd.events = POLLIN | (out.len ? POLLOUT : 0);
+
+		if(poll(&pfd, 1, -1) == -1) {
 			if(errno == EINTR)
 				continue;
-			else
-				return result;
+			fprintf(stderr, "%s: poll() failed: %s\n", argv0, strerror(errno));
+			return 1;
+		}
+
+		if(pfd.revents & POLLOUT) {
+			if(framebuf_write(sock, &out) == -1 && errno != EINTR && errno != EAGAIN) {
+				fprintf(stderr, "%s: Connection closed by server\n", argv0);
+				return 1;
+			}
+		}
+
+		if(pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+			result = framebuf_read(sock, &in);
+
+			if(!result || (result == -1 && errno != EINTR && errno != EAGAIN)) {
+				fprintf(stderr, "%s: Connection closed by server\n", argv0);
+				return 1;
+			}
 		}
-		written += result;
-		buf += result;
-		count -= result;
 	}
-	
-	return written;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if(verbose)
+		fprintf(stderr, "%s: %d commands in %.1f ms\n", argv0, done, elapsed(&start, &end));
+
+	free(line);
+
+	if(file != stdin)
+		fclose(file);
+
+	return status;
+}
+
+/* Running a list of independent commands on a pool of hosts. Every host
+   gets a single session, in which it runs as many commands at the same time
+   as it has slots, each on a channel of its own. Whenever a slot frees up,
+   the host takes the next command from the list, so hosts that are faster,
+   or have less to do, end up running more of them. Commands that were still
+   running on a host whose connection failed are put back in front of the
+   list, and tried again on another host, at most TASK_RETRIES times. */
+
+#define TASK_RETRIES 2
+
+struct task {
+	char *command;
+	enum {TASK_QUEUED, TASK_RUNNING, TASK_DONE, TASK_FAILED} state;
+	int attempts;
+	int status;
+	const char *host;
+	struct timespec start, end;
+};
+
+struct worker {
+	char *host;
+	char *user;
+	int slots;
+	enum state state;
+	char error[256];
+
+	struct addrinfo *ai;
+	struct connector conn;
+	int sock;
+	int pfd, npfd;
+
+	struct framebuf *in, *out;
+	int *tasks;		/* The task running on each channel, or -1 */
+	struct stream *lines;	/* Standard output and error of each channel */
+	char *buf;
+	int running;
+	int done;
+};
+
+struct pool {
+	struct task *tasks;
+	int ntasks;
+	int first;		/* There are no queued tasks before this one */
+	int finished;
+	int failed;
+	FILE *log;
+	struct timespec start;
+};
+
+/* Read the commands, one per line, skipping empty lines and comments */
+
+static bool pool_read(struct pool *p, const char *filename) {
+	FILE *file;
+	struct task *newtasks;
+	char *line = NULL, *command;
+	size_t size = 0;
+	ssize_t len;
+
+	if(!strcmp(filename, "-"))
+		file = stdin;
+	else if(!(file = fopen(filename, "r")))
+		return false;
+
+	while((len = getline(&line, &size, file)) != -1) {
+		if(len && line[len - 1] == '\n')
+			line[--len] = 0;
+
+		for(command = line; *command == ' ' || *command == '\t'; command++);
+
+		if(!*command || *command == '#')
+			continue;
+
+		if(!(newtasks = realloc(p->tasks, (p->ntasks + 1) * sizeof *newtasks)))
+			return false;
+
+		p->tasks = newtasks;
+		memset(&p->tasks[p->ntasks], 0, sizeof *p->tasks);
+
+		if(!(p->tasks[p->ntasks++].command = strdup(command)))
+			return false;
+	}
+
+	free(line);
+
+	if(file != stdin)
+		fclose(file);
+
+	return true;
+}
+
+/* Record how a task ended */
+
+static void pool_finish(struct pool *p, struct task *t, int state, int status) {
+	clock_gettime(CLOCK_MONOTONIC, &t->end);
+	t->state = state;
+	t->status = status;
+	p->finished++;
+
+	if(state == TASK_FAILED) {
+		p->failed++;
+		fprintf(stderr, "%s: Command %d failed on %s: %s\n", argv0, (int)(t - p->tasks) + 1, t->host ? t->host : "no host", t->command);
+	} else if(status) {
+		p->failed++;
+		fprintf(stderr, "%s: Command %d exited with status %d on %s: %s\n", argv0, (int)(t - p->tasks) + 1, status, t->host, t->command);
+	}
+
+	if(!p->log)
+		return;
+
+	fprintf(p->log, "%d\t%s\t", (int)(t - p->tasks) + 1, t->host ? t->host : "-");
+
+	if(state == TASK_FAILED)
+		fprintf(p->log, "-");
+	else
+		fprintf(p->log, "%d", status);
+
+	fprintf(p->log, "\t%d\t%.1f\t%.1f\t%s\n", t->attempts, t->attempts ? elapsed(&p->start, &t->start) : 0.0, t->attempts ? elapsed(&t->start, &t->end) : 0.0, t->command);
+	fflush(p->log);
 }
 
-/* Safe and fast string building */
+static void worker_fail(struct pool *p, struct worker *w, const char *what, int err) {
+	struct task *t;
+	int i;
+
+	snprintf(w->error, sizeof w->error, "%s%s%s", what, err ? ": " : "", err ? strerror(err) : "");
+	w->state = STATE_FAILED;
 
-static void safecpy(char **dest, int *len, const char *source, bool terminate) {
-	while(*source && *len) {
-		*(*dest)++ = *source++;
-		(*len)--;
+	if(w->sock != -1) {
+		close(w->sock);
+		w->sock = -1;
 	}
 
-	if(terminate && *len) {
-		*(*dest)++ = 0;
-		(*len)--;
+	if(!w->tasks)
+		return;
+
+	/* Give the commands it was running to another host */
+
+	for(i = 0; i < w->slots; i++) {
+		if(w->tasks[i] == -1)
+			continue;
+
+		t = &p->tasks[w->tasks[i]];
+		w->lines[2 * i].eof = w->lines[2 * i + 1].eof = true;
+		stream_writelines(&w->lines[2 * i], w->host);
+		stream_writelines(&w->lines[2 * i + 1], w->host);
+
+		if(t->attempts > TASK_RETRIES) {
+			pool_finish(p, t, TASK_FAILED, 0);
+		} else {
+			t->state = TASK_QUEUED;
+			if(w->tasks[i] < p->first)
+				p->first = w->tasks[i];
+		}
+
+		w->tasks[i] = -1;
 	}
+
+	w->running = 0;
 }
 
-static void closestdin(void) {
-	int fd;
+static void worker_start(struct fanout *f, struct pool *p, struct worker *w) {
+	struct addrinfo hint;
+	char name[NI_MAXHOST];
+	const char *port;
+	int err;
 
-	close(0);
+	w->sock = -1;
+	port = host_port(w->host, name, sizeof name, f->port);
 
-	if((fd = open("/dev/null", O_RDONLY)) < 0) {
-		fprintf(stderr, "%s: Error opening /dev/null: %s\n", argv0, strerror(errno));
-		exit(1);
+	memset(&hint, '\0', sizeof hint);
+	hint.ai_family = f->af;
+	hint.ai_socktype = SOCK_STREAM;
+
+	if((err = getaddrinfo(name, port, &hint, &w->ai))) {
+		snprintf(w->error, sizeof w->error, "Error looking up host: %s", gai_strerror(err));
+		w->state = STATE_FAILED;
+		return;
 	}
 
-	if(fd != 0) {
-		dup2(fd, 0);
-		close(fd);
+	if(!connector_init(&w->conn, w->ai, f->timeout, false)) {
+		worker_fail(p, w, "Could not make a connection", w->conn.error);
+		return;
 	}
+
+	w->conn.anyport = f->password;
+
+	w->state = STATE_CONNECTING;
 }
 
-int main(int argc, char **argv) {
+/* Hand out commands to the free slots of a host */
+
+static void worker_assign(struct pool *p, struct worker *w) {
+	struct task *t;
+	int len, i;
+
+	for(i = 0; i < w->slots && w->running < w->slots; i++) {
+		if(w->tasks[i] != -1)
+			continue;
+
+		while(p->first < p->ntasks && p->tasks[p->first].state != TASK_QUEUED)
+			p->first++;
+
+		if(p->first == p->ntasks)
+			return;
+
+		t = &p->tasks[p->first];
+		len = strlen(t->command);
+
+		if(len > FRAME_MAX) {
+			fprintf(stderr, "%s: Command too long: %.40s...\n", argv0, t->command);
+			pool_finish(p, t, TASK_FAILED, 0);
+			continue;
+		}
+
+		if(framebuf_room(w->out) < 2 * FRAME_HDR + len)
+			return;
+
+		frame_put(w->out, FRAME_EXEC, i, t->command, len);
+		frame_put(w->out, FRAME_STDIN, i, NULL, 0);
+
+		t->state = TASK_RUNNING;
+		t->attempts++;
+		t->host = w->host;
+		clock_gettime(CLOCK_MONOTONIC, &t->start);
+		stream_init(&w->lines[2 * i], -1, 1, w->buf + 2 * i * BUFLEN, false);
+		stream_init(&w->lines[2 * i + 1], -1, 2, w->buf + (2 * i + 1) * BUFLEN, false);
+		w->tasks[i] = t - p->tasks;
+		w->running++;
+	}
+}
+
+/* Add output of a command to its channel, writing out complete lines */
+
+static void worker_output(struct worker *w, struct stream *s, const char *data, int len) {
+	int n;
+
+	while(len) {
+		n = BUFLEN - s->len < len ? BUFLEN - s->len : len;
+		memcpy(s->buf + s->len, data, n);
+		s->len += n;
+		data += n;
+		len -= n;
+		stream_writelines(s, w->host);
+	}
+}
+
+/* Handle the frames from a host, returns false on a protocol error */
+
+static bool worker_frames(struct pool *p, struct worker *w) {
+	struct frame fr;
+	struct task *t;
+	int result, slot;
+
+	while((result = frame_peek(w->in, &fr)) == 1) {
+		slot = fr.chan;
+
+		if(fr.type == FRAME_READY) {
+			frame_next(w->in, &fr);
+			continue;
+		}
+
+		if(slot >= w->slots || w->tasks[slot] == -1)
+			return false;
+
+		t = &p->tasks[w->tasks[slot]];
+
+		switch(fr.type) {
+			case FRAME_STDOUT:
+			case FRAME_STDERR:
+				worker_output(w, &w->lines[2 * slot + (fr.type == FRAME_STDERR)], fr.data, fr.len);
+				break;
+
+			case FRAME_EXIT:
+				w->lines[2 * slot].eof = w->lines[2 * slot + 1].eof = true;
+				stream_writelines(&w->lines[2 * slot], w->host);
+				stream_writelines(&w->lines[2 * slot + 1], w->host);
+				pool_finish(p, t, TASK_DONE, fr.len ? (unsigned char)*fr.data : 1);
+				w->tasks[slot] = -1;
+				w->running--;
+				w->done++;
+				break;
+
+			default:
+				return false;
+		}
+
+		frame_next(w->in, &fr);
+	}
+
+	return result != -1;
+}
+
+static void worker_step(struct fanout *f, struct pool *p, struct worker *w, struct pollfd *pfd) {
+	char buf[BUFLEN], offer[1024];
+	int result, len, one = 1, i;
+
+	switch(w->state) {
+		case STATE_CONNECTING:
+			privileged(true);
+			result = connector_step(&w->conn, pfd);
+			privileged(false);
+
+			if(!result)
+				return;
+
+			if(result == -1) {
+				worker_fail(p, w, "Could not make a connection", w->conn.error ? w->conn.error : ECONNREFUSED);
+				return;
+			}
+
+			w->sock = w->conn.sock;
+			connector_free(&w->conn);
+			freeaddrinfo(w->ai);
+			w->ai = NULL;
+
+			/* A session, without a command or a stderr connection of its own */
+
+			if((len = build_request(buf, sizeof buf, "00", f->password ? w->user : f->luser, f->password ? f->password : w->user, 0, NULL)) == -1 || safewrite(w->sock, buf, len) == -1) {
+				worker_fail(p, w, "Unable to send required information", errno);
+				return;
+			}
+
+			w->state = STATE_WAITING;
+			return;
+
+		case STATE_WAITING:
+			if(!pfd->revents)
+				return;
+
+			if((result = negotiate(w->sock, FEATURE_SESSION, offer, sizeof offer)) == -1) {
+				worker_fail(p, w, "Didn't receive answer from server", errno);
+				return;
+			}
+
+			if(!result || !feature_has(offer, FEATURE_SESSION)) {
+				worker_fail(p, w, "Server does not support sessions", 0);
+				return;
+			}
+
+			if(!(w->in = malloc(sizeof *w->in)) || !(w->out = malloc(sizeof *w->out))
+					|| !(w->tasks = malloc(w->slots * sizeof *w->tasks))
+					|| !(w->lines = malloc(2 * w->slots * sizeof *w->lines))
+					|| !(w->buf = malloc(2 * w->slots * BUFLEN))) {
+				worker_fail(p, w, "Could not allocate buffers", errno);
+				return;
+			}
+
+			w->in->start = w->in->len = 0;
+			w->out->start = w->out->len = 0;
+
+			for(i = 0; i < w->slots; i++)
+				w->tasks[i] = -1;
+
+			setsockopt(w->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+			fcntl(w->sock, F_SETFL, fcntl(w->sock, F_GETFL) | O_NONBLOCK);
+			w->state = STATE_RUNNING;
+			worker_assign(p, w);
+			return;
+
+		case STATE_RUNNING:
+			if(pfd->revents & POLLOUT) {
+				if(framebuf_write(w->sock, w->out) == -1 && errno != EINTR && errno != EAGAIN) {
+					worker_fail(p, w, "Connection closed by server", errno);
+					return;
+				}
+			}
+
+			if(pfd->revents & (POLLIN | POLLHUP | POLLERR)) {
+				result = framebuf_read(w->sock, w->in);
+
+				if(!result || (result == -1 && errno != EINTR && errno != EAGAIN)) {
+					worker_fail(p, w, "Connection closed by server", result ? errno : 0);
+					return;
+				}
+			}
+
+			if(!worker_frames(p, w)) {
+				worker_fail(p, w, "Invalid data from server", 0);
+				return;
+			}
+
+			worker_assign(p, w);
+
+			return;
+
+		default:
+			return;
+	}
+}
+
+static int worker_pollfds(struct worker *w, struct pollfd *pfd) {
+	switch(w->state) {
+		case STATE_CONNECTING:
+			w->npfd = w->conn.slots;
+			return connector_pollfds(&w->conn, pfd);
+
+		case STATE_WAITING:
+		case STATE_RUNNING:
+			w->npfd = 1;
+			pfd->fd = w->sock;
+			pfd->events = POLLIN | (w->state == STATE_RUNNING && w->out->len ? POLLOUT : 0);
+			pfd->revents = 0;
+			return -1;
+
+		default:
+			w->npfd = 0;
+			return -1;
+	}
+}
+
+static int schedule(struct fanout *f, const char *filename, const char *logname) {
+	struct pool p = {NULL};
+	struct worker *workers, *w;
+	struct pollfd *pfd;
+	struct timespec end;
+	char *s;
+	int npfd, timeout, t, active, i;
+	bool dropped = false;
+
+	privileged(false);
+
+	if(!pool_read(&p, filename)) {
+		fprintf(stderr, "%s: Could not read commands from %s: %s\n", argv0, filename, strerror(errno));
+		return 1;
+	}
+
+	if(logname && !(p.log = fopen(logname, "w"))) {
+		fprintf(stderr, "%s: Could not open %s: %s\n", argv0, logname, strerror(errno));
+		return 1;
+	}
+
+	if(!(workers = calloc(f->nsessions, sizeof *workers))) {
+		fprintf(stderr, "%s: Could not allocate memory: %s\n", argv0, strerror(errno));
+		return 1;
+	}
+
+	/* Each host can be given a number of slots as host/slots */
+
+	for(i = 0; i < f->nsessions; i++) {
+		w = &workers[i];
+		w->host = f->sessions[i].host;
+		w->user = f->sessions[i].user;
+		w->slots = 1;
+
+		if((s = strrchr(w->host, '/'))) {
+			*s++ = 0;
+			w->slots = number(s);
+
+			if(w->slots < 1 || w->slots > CHANNELS) {
+				fprintf(stderr, "%s: Invalid number of slots for %s: %s\n", argv0, w->host, s);
+				return 1;
+			}
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	clock_gettime(CLOCK_MONOTONIC, &p.start);
+
+	/* Connect to all hosts at once */
+
+	npfd = 0;
+
+	for(i = 0; i < f->nsessions; i++) {
+		worker_start(f, &p, &workers[i]);
+		npfd += workers[i].state == STATE_CONNECTING ? workers[i].conn.slots : 1;
+	}
+
+	if(!(pfd = calloc(npfd + 1, sizeof *pfd))) {
+		fprintf(stderr, "%s: Could not allocate memory: %s\n", argv0, strerror(errno));
+		return 1;
+	}
+
+	while(p.finished < p.ntasks) {
+		npfd = 0;
+		timeout = -1;
+		active = 0;
+
+		for(i = 0; i < f->nsessions; i++) {
+			w = &workers[i];
+
+			if(w->state == STATE_DONE || w->state == STATE_FAILED)
+				continue;
+
+			active++;
+			w->pfd = npfd;
+			t = worker_pollfds(w, pfd + npfd);
+			npfd += w->npfd;
+
+			if(t != -1 && (timeout == -1 || t < timeout))
+				timeout = t;
+		}
+
+		/* Once no more ports need to be bound, drop privileges for good */
+
+		if(!dropped) {
+			for(i = 0; i < f->nsessions; i++)
+				if(workers[i].state == STATE_CONNECTING)
+					break;
+
+			if(i == f->nsessions) {
+				if(!drop_privileges())
+					return 1;
+				dropped = true;
+			}
+		}
+
+		/* Without hosts, what is left can't be run */
+
+		if(!active) {
+			for(i = 0; i < p.ntasks; i++)
+				if(p.tasks[i].state == TASK_QUEUED)
+					pool_finish(&p, &p.tasks[i], TASK_FAILED, 0);
+			break;
+		}
+
+		if(poll(pfd, npfd, timeout) == -1) {
+			if(errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: poll() failed: %s\n", argv0, strerror(errno));
+			return 1;
+		}
+
+		for(i = 0; i < f->nsessions; i++) {
+			w = &workers[i];
+
+			if(w->state != STATE_DONE && w->state != STATE_FAILED)
+				worker_step(f, &p, w, pfd + w->pfd);
+		}
+
+		/* Let the other hosts take over the work of those that failed */
+
+		for(i = 0; i < f->nsessions; i++)
+			if(workers[i].state == STATE_RUNNING && workers[i].running < workers[i].slots)
+				worker_assign(&p, &workers[i]);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	for(i = 0; i < f->nsessions; i++) {
+		w = &workers[i];
+
+		if(w->sock != -1)
+			close(w->sock);
+
+		if(w->state == STATE_FAILED)
+			fprintf(stderr, "%s: %s: %s\n", argv0, w->host, w->error);
+		else if(f->verbose)
+			fprintf(stderr, "%s: %s: ran %d commands\n", argv0, w->host, w->done);
+	}
+
+	if(f->verbose || p.failed)
+		fprintf(stderr, "%s: %d commands on %d hosts in %.1f ms, %d failed\n", argv0, p.ntasks, f->nsessions, elapsed(&p.start, &end), p.failed);
+
+	if(p.log)
+		fclose(p.log);
+
+	return p.failed ? 1 : 0;
+}
+
+static int rsh(int argc, char **argv) {
 	char *user = NULL;
 	char *luser = NULL;
 	char *host = NULL;
 	char *port = "shell";
+	char *password = NULL;
 	char *p;
-	char lport[5];
-	
-	struct passwd *pw;
+	char lport[6];
 	
 	int af = AF_UNSPEC;
-	struct addrinfo hint, *ai, *aip, *lai;
+	struct lookup lookup = {NULL};
+	struct addrinfo *aip;
 	int err, sock = -1, lsock = -1, esock = -1, i;
 	
 	int opt;
 
 	bool verbose = false;
+	bool compress = false;
+	bool fastopen = false;
+	bool nocache = false;
+	bool rexec = false;
+	bool tls = false;
+	int sent = 0;
+	double bindtime;
+	struct tuning tuning;
+	bool bulk = false;
+
+	int timeout = 0;
 
-	char hostaddr[NI_MAXHOST];
-	char portnr[NI_MAXSERV];
+	char offer[1024];
+	char *masterpath = NULL;
+	char *batchfile = NULL;
+	char *logfile = NULL;
+	char *control = NULL;
+	char *bufp;
 
-	char buf[3][BUFLEN], *bufp[3];
-	int len[3], wlen;
+	struct fanout f = {.window = 64};
+
+	char *buf[3] = {NULL};
+	int len = 0;
 	
-	fd_set infd, outfd, infdset, outfdset, errfd;
-	int maxfd;
+	struct stream streams[3];
+	struct pollfd pfd[6];
 	
 	int flags;
 	
 	argv0 = argv[0];
-	
-	/* Lookup local username */
-	
-	if (!(pw = getpwuid(getuid()))) {
-		fprintf(stderr, "%s: Could not lookup username: %s\n", argv0, strerror(errno));
-		return 1;
-	}
-	user = luser = pw->pw_name;
+
+	clock_gettime(CLOCK_MONOTONIC, &timing.start);
+	clock_gettime(CLOCK_REALTIME, &timing.wallclock);
+	timing.last = timing.start;
 	
 	/* if we were called with something else from rsh use the name as host */
 	host = basename(argv0);
 
-	if(!strcmp(host, "rsh") || !strcmp(host, "rsh-redone-rsh"))
+	if(!strcmp(host, "rsh") || !strcmp(host, "rsh-static") || !strcmp(host, "rsh-redone-rsh"))
 		host = NULL;
 
 	/* Process options */
 			
-	while((opt = getopt(argc, argv, "-l:p:46vn")) != -1) {
+	while((opt = getopt(argc, argv, "-l:p:t:46vnxeazTCsb::j:H:f:F:R:E:rM:S:B:o:")) != -1) {
 		switch(opt) {
 			case 1:
-				if(!host) {
+				if(!host && !f.nsessions) {
 					host = optarg;
 					break;
 				} else {
@@ -156,6 +3377,13 @@ int main(int argc, char **argv) {
 			case 'p':
 				port = optarg;
 				break;
+			case 't':
+				if((timeout = parse_timeout(optarg)) == -1) {
+					fprintf(stderr, "%s: Invalid timeout!\n", argv0);
+					usage();
+					return 1;
+				}
+				break;
 			case '4':
 				af = AF_INET;
 				break;
@@ -165,9 +3393,89 @@ int main(int argc, char **argv) {
 			case 'v':
 				verbose = true;
 				break;
+			case 'j':
+				timing.json = optarg;
+				break;
+			case 'x':
+				rexec = true;
+				break;
+			case 'e':
+				tls = true;
+				break;
+			case 'z':
+				compress = true;
+				break;
+			case 'T':
+				fastopen = true;
+				break;
+			case 'C':
+				nocache = true;
+				break;
+			case 'b':
+				if(!tuning_parse(&tuning, optarg)) {
+					fprintf(stderr, "%s: Invalid bulk transfer settings: %s\n", argv0, optarg);
+					return 1;
+				}
+				bulk = true;
+				break;
 			case 'n':
 				closestdin();
 				break;
+			case 'a':
+				f.aggregate = true;
+				break;
+			case 's':
+				f.input.spool = true;
+				break;
+			case 'M':
+				masterpath = optarg;
+				break;
+			case 'S':
+				control = optarg;
+				break;
+			case 'B':
+				batchfile = optarg;
+				break;
+			case 'o':
+				logfile = optarg;
+				break;
+			case 'H':
+				if(!addhosts(&f, optarg)) {
+					fprintf(stderr, "%s: Could not allocate memory: %s\n", argv0, strerror(errno));
+					return 1;
+				}
+				break;
+			case 'f':
+				if(!addhostfile(&f, optarg)) {
+					fprintf(stderr, "%s: Could not read hosts from %s: %s\n", argv0, optarg, strerror(errno));
+					return 1;
+				}
+				break;
+			case 'F':
+				f.window = number(optarg);
+				if(f.window < 1) {
+					fprintf(stderr, "%s: Invalid fanout!\n", argv0);
+					return 1;
+				}
+				break;
+			case 'R':
+				f.degree = number(optarg);
+				if(f.degree < 2) {
+					fprintf(stderr, "%s: Invalid number of relays!\n", argv0);
+					return 1;
+				}
+				break;
+			case 'E':
+				f.hedge = number(optarg);
+				if(f.hedge < 1 || f.hedge > 100) {
+					fprintf(stderr, "%s: Invalid percentile!\n", argv0);
+					return 1;
+				}
+				break;
+			case 'r':
+				/* Only used on relays, see tree() */
+				f.relay = true;
+				break;
 			default:
 				fprintf(stderr, "%s: Unknown option!\n", argv0);
 				usage();
@@ -176,13 +3484,136 @@ int main(int argc, char **argv) {
 	}
 
 done:
+	/* Only now that the options are known, commit memory for the request */
+
+	if(!(buf[0] = malloc(BUFLEN))) {
+		fprintf(stderr, "%s: Could not allocate buffer: %s\n", argv0, strerror(errno));
+		return 1;
+	}
+
+	/* With rexec, we don't need any privileges at all */
+
+	if(rexec) {
+		if(setuid(getuid())) {
+			fprintf(stderr, "%s: Unable to drop privileges: %s\n", argv0, strerror(errno));
+			return 1;
+		}
+
+		if(!strcmp(port, "shell"))
+			port = "exec";
+
+		if(!(password = rexec_password())) {
+			fprintf(stderr, "%s: Could not read password: %s\n", argv0, strerror(errno));
+			return 1;
+		}
+	}
+
+	/* The request has to wait for the handshake */
+
+	if(tls)
+		fastopen = false;
+
+	if(f.nsessions) {
+		if(tls) {
+			fprintf(stderr, "%s: Can't combine -e with -H or -f!\n", argv0);
+			usage();
+			return 1;
+		}
+
+		if(!(luser = local_user())) {
+			fprintf(stderr, "%s: Could not lookup username: %s\n", argv0, errno == ENOENT ? "unknown user ID" : strerror(errno));
+			return 1;
+		}
+
+		if(!user)
+			user = luser;
+
+		for(i = 0; i < f.nsessions; i++) {
+			f.sessions[i].user = user;
+			if((p = strchr(f.sessions[i].host, '@'))) {
+				f.sessions[i].user = f.sessions[i].host;
+				*p = '\0';
+				f.sessions[i].host = p + 1;
+			}
+		}
+
+		f.luser = luser;
+		f.password = password;
+		f.port = port;
+		f.af = af;
+		f.timeout = timeout;
+		f.verbose = verbose;
+
+		/* Distribute the commands from a file over the hosts */
+
+		if(batchfile) {
+			if(optind != argc) {
+				fprintf(stderr, "%s: No command allowed with -B!\n", argv0);
+				usage();
+				return 1;
+			}
+
+			return schedule(&f, batchfile, logfile);
+		}
+
+		if(optind == argc) {
+			fprintf(stderr, "%s: No command specified!\n", argv0);
+			usage();
+			return 1;
+		}
+
+		if(f.degree && f.aggregate) {
+			fprintf(stderr, "%s: Can't collect output from relays!\n", argv0);
+			usage();
+			return 1;
+		}
+
+		if(f.hedge && (f.degree || f.aggregate)) {
+			fprintf(stderr, "%s: Can't combine -E with -R or -a!\n", argv0);
+			usage();
+			return 1;
+		}
+
+		/* Relays would need the password on their command line */
+
+		if(f.degree && rexec) {
+			fprintf(stderr, "%s: Can't combine -x with -R!\n", argv0);
+			usage();
+			return 1;
+		}
+
+		bufp = buf[0];
+		len = BUFLEN;
+		build_command(&bufp, &len, argc - optind, argv + optind);
+
+		if(!len) {
+			fprintf(stderr, "%s: Arguments too long!\n", argv0);
+			return 1;
+		}
+
+		/* A relay is the first of its own hosts */
+
+		f.command = buf[0];
+		f.sessions[0].local = f.relay;
+		f.argc = argc - optind;
+		f.argv = argv + optind;
+
+		return f.hedge ? hedge(&f) : fanout(&f);
+	}
+
 	if(!host) {
 		fprintf(stderr, "%s: No host specified!\n", argv0);
 		usage();
 		return 1;
 	}
 	
-	if(optind == argc) {
+	if(masterpath || batchfile) {
+		if(optind != argc) {
+			fprintf(stderr, "%s: No command allowed with %s!\n", argv0, masterpath ? "-M" : "-B");
+			usage();
+			return 1;
+		}
+	} else if(optind == argc) {
 		execv(BINDIR "/rlogin", argv);
 		fprintf(stderr, "%s: Could not execute " BINDIR "/rlogin: %s\n", argv0, strerror(errno));
 		return 1;
@@ -194,161 +3625,317 @@ done:
 		host = p + 1;
 	}
 	
-	/* Resolve hostname and try to make a connection */
-	
-	memset(&hint, '\0', sizeof hint);
-	hint.ai_family = af;
-	hint.ai_socktype = SOCK_STREAM;
-	
-	err = getaddrinfo(host, port, &hint, &ai);
-	
-	if(err) {
-		fprintf(stderr, "%s: Error looking up host: %s\n", argv0, gai_strerror(err));
-		return 1;
-	}
-	
-	hint.ai_flags = AI_PASSIVE;
-	
-	for(aip = ai; aip; aip = aip->ai_next) {
-		if(getnameinfo(aip->ai_addr, aip->ai_addrlen, hostaddr, sizeof hostaddr, portnr, sizeof portnr, NI_NUMERICHOST | NI_NUMERICSERV)) {
-			fprintf(stderr, "%s: Error resolving address: %s\n", argv0, strerror(errno));
-			return 1;
-		}
-		if(verbose) fprintf(stderr, "Trying %s port %s...", hostaddr, portnr);
-		
-		if((sock = socket(aip->ai_family, aip->ai_socktype, aip->ai_protocol)) == -1) {
-			if(verbose) fprintf(stderr, " Could not open socket: %s\n", strerror(errno));
-			continue;
-		}
+	/* Run the command through a master if there is one */
+
+	if(control && !masterpath && !batchfile) {
+		if((sock = master_connect(control)) != -1) {
+			if(setuid(getuid())) {
+				fprintf(stderr, "%s: Unable to drop privileges: %s\n", argv0, strerror(errno));
+				return 1;
+			}
 
-		hint.ai_family = aip->ai_family;
+			bufp = buf[0];
+			len = BUFLEN;
+			build_command(&bufp, &len, argc - optind, argv + optind);
 
-		/* Bind to a privileged port */
-				
-		for(i = 1023; i >= 512; i--) {
-			snprintf(lport, sizeof lport, "%d", i);
-			err = getaddrinfo(NULL, lport, &hint, &lai);
-			if(err) {
-				fprintf(stderr, " Error looking up localhost: %s\n", gai_strerror(err));
+			if(!len) {
+				fprintf(stderr, "%s: Arguments too long!\n", argv0);
 				return 1;
 			}
-			
-			err = bind(sock, lai->ai_addr, lai->ai_addrlen);
-			
-			freeaddrinfo(lai);
-			
-			if(err)
-				continue;
-			else
-				break;
-		}
-		
-		if(err) {
-			if(verbose) fprintf(stderr, " Could not bind to privileged port: %s\n", strerror(errno));
-			continue;
-		}
-		
-		if(connect(sock, aip->ai_addr, aip->ai_addrlen) == -1) {
-			if(verbose) fprintf(stderr, " Connection failed: %s\n", strerror(errno));
-			continue;
+
+			if((err = relay_frames(sock, buf[0], 0)) == -1) {
+				fprintf(stderr, "%s: Lost connection to master\n", argv0);
+				return 1;
+			}
+
+			return err;
 		}
-		if(verbose) fprintf(stderr, " Connected.\n");
-		break;
+
+		if(verbose)
+			fprintf(stderr, "%s: No master on %s, connecting directly\n", argv0, control);
 	}
-	
-	if(!aip) {
-		fprintf(stderr, "%s: Could not make a connection.\n", argv0);
+
+	/* A master already knows who we are, so only look it up now */
+
+	if(!(luser = local_user())) {
+		fprintf(stderr, "%s: Could not lookup username: %s\n", argv0, errno == ENOENT ? "unknown user ID" : strerror(errno));
 		return 1;
 	}
+
+	if(!user)
+		user = luser;
+
+	/* An rexec request has the remote user and the password where the
+	   local and remote user would be */
+
+	if(rexec) {
+		luser = user;
+		user = password;
+	}
+
+	/* From here on, keep track of how long everything takes */
+
+	timing.on = true;
+	timing.verbose = verbose;
+	timing.host = host;
+	timing.port = port;
+	phase_done(PHASE_SETUP);
+
+	/* A unix socket on this host. We connect as ourselves, the server asks
+	   the kernel who we are instead of looking at the port. */
+
+	if(strchr(host, '/')) {
+		if(setuid(getuid())) {
+			fprintf(stderr, "%s: Unable to drop privileges: %s\n", argv0, strerror(errno));
+			return 1;
+		}
+
+		if((sock = connect_unix(host)) == -1) {
+			timing.next = PHASE_CONNECT;
+			fprintf(stderr, "%s: Could not make a connection: %s\n", argv0, strerror(errno));
+			return 1;
+		}
+
+		phase_done(PHASE_CONNECT);
+		snprintf(timing.addr, sizeof timing.addr, "%s", host);
+
+		/* There is no way back for stderr, it has to come over this socket.
+		   Nobody else can see it either, so it doesn't need TLS. */
+
+		fastopen = false;
+		tls = false;
+		lport[0] = PROTO_MARK;
+		lport[1] = '0';
+		lport[2] = 0;
+		goto connected;
+	}
+
+	/* Resolve hostname and try to make a connection */
 	
-	/* Create a socket for the incoming connection for stderr output */
-	
-	if((lsock = socket(aip->ai_family, aip->ai_socktype, aip->ai_protocol)) == -1) {
-		fprintf(stderr, "%s: Could not open socket: %s\n", argv0, strerror(errno));
+	lookup.host = host;
+	lookup.port = port;
+	lookup.family = af;
+	lookup.bypass = nocache;
+
+	if((err = lookup_host(&lookup))) {
+		fprintf(stderr, "%s: Error looking up host: %s\n", argv0, gai_strerror(err));
 		return 1;
 	}
-	
-	hint.ai_family = aip->ai_family;
-	
-	freeaddrinfo(ai);
-	
-	for(i--; i >= 512; i--) {
-		snprintf(lport, sizeof lport, "%d", i);
-		err = getaddrinfo(NULL, lport, &hint, &lai);
-		if(err) {
-			fprintf(stderr, "%s: Error looking up localhost: %s\n", argv0, gai_strerror(err));
+
+	phase_done(PHASE_RESOLVE);
+
+	if(verbose)
+		lookup_report(&lookup);
+
+	/* With Fast Open the request goes out with the SYN, so it has to be
+	   complete before we know which address we will be connected to.
+	   Unless told otherwise, listen for stderr on an IPv6 socket, which
+	   accepts connections from either family. */
+
+	if(fastopen) {
+		lport[0] = PROTO_MARK;
+
+		if(masterpath || batchfile) {
+			lport[1] = '0';
+			lport[2] = 0;
+		} else if((af == AF_INET || (lsock = listen_stderr(AF_INET6, rexec, lport + 1, sizeof lport - 1)) == -1)
+				&& (lsock = listen_stderr(AF_INET, rexec, lport + 1, sizeof lport - 1)) == -1) {
+			fprintf(stderr, "%s: Could not create stderr socket: %s\n", argv0, errno == EADDRINUSE ? "all privileged ports in use" : strerror(errno));
 			return 1;
 		}
 
-		err = bind(lsock, lai->ai_addr, lai->ai_addrlen);
+		if((len = build_request(buf[0], BUFLEN, lport, luser, user, masterpath || batchfile ? 0 : argc - optind, argv + optind)) == -1) {
+			fprintf(stderr, "%s: Arguments too long!\n", argv0);
+			return 1;
+		}
+	}
+	
+	sock = connect_resv(lookup.ai, timeout, verbose, rexec, fastopen ? buf[0] : NULL, len, &sent, &aip, &bindtime);
+
+	/* What the cache knew didn't work, ask the resolver again */
 
-		freeaddrinfo(lai);
+	if(sock == -1 && lookup.hit && errno != EADDRINUSE) {
+		lookup_done(&lookup, NULL, 0);
+		lookup_free(&lookup);
+		lookup.bypass = true;
 
-		if(err)
-			continue;
+		if(!lookup_host(&lookup))
+			sock = connect_resv(lookup.ai, timeout, verbose, rexec, fastopen ? buf[0] : NULL, len, &sent, &aip, &bindtime);
 		else
-			break;
+			errno = EHOSTUNREACH;
 	}
-	
-	if(err) {
-		fprintf(stderr, "%s: Could not bind to privileged port: %s\n", argv0, strerror(errno));
+
+	if(sock == -1) {
+		timing.next = errno == EADDRINUSE ? PHASE_BIND : PHASE_CONNECT;
+		fprintf(stderr, "%s: Could not make a connection: %s\n", argv0, errno == EADDRINUSE ? "all privileged ports in use" : strerror(errno));
+		if(timing.next == PHASE_CONNECT)
+			lookup_done(&lookup, NULL, 0);
 		return 1;
 	}
+
+	/* The search for a free port is part of each connection attempt */
+
+	phase_done(PHASE_CONNECT);
+	timing.took[PHASE_CONNECT] -= bindtime;
+	timing.took[PHASE_BIND] = bindtime;
+	timing.at[PHASE_BIND] = timing.at[PHASE_RESOLVE] + bindtime;
+	timing.done[PHASE_BIND] = true;
+	getnameinfo(aip->ai_addr, aip->ai_addrlen, timing.addr, sizeof timing.addr, NULL, 0, NI_NUMERICHOST);
+	lookup_done(&lookup, aip, timing.took[PHASE_CONNECT]);
+
+	/* Bigger buffers need privileges too, so do this before dropping them */
+
+	if(bulk) {
+		if(!tuning_apply(sock, &tuning) && verbose)
+			fprintf(stderr, "%s: Could not select congestion control %s: %s\n", argv0, tuning.congestion, strerror(errno));
+
+		if(verbose) {
+			fprintf(stderr, "%s: Round trip time %.1f ms", argv0, tuning.rttus / 1e3);
+			if(tuning.sndbuf)
+				fprintf(stderr, ", send buffer %d", tuning.sndbuf);
+			if(tuning.rcvbuf)
+				fprintf(stderr, ", receive buffer %d", tuning.rcvbuf);
+			if(tuning.congested)
+				fprintf(stderr, ", congestion control %s", tuning.congestion);
+			fprintf(stderr, "\n");
+		}
+	}
+	
+	/* Create a socket for the incoming connection for stderr output.
+	   The leading zero tells the server we can do without it. With TLS,
+	   it has to, the stderr connection wouldn't be encrypted. */
 	
-	if(listen(lsock, 10)) {
-		fprintf(stderr, "%s: Could not listen: %s\n", argv0, strerror(errno));
+	lport[0] = PROTO_MARK;
+
+	if(tls) {
+		lport[1] = '0';
+		lport[2] = 0;
+	} else if(!fastopen && !masterpath && !batchfile && (lsock = listen_stderr(aip->ai_family, rexec, lport + 1, sizeof lport - 1)) == -1) {
+		fprintf(stderr, "%s: Could not create stderr socket: %s\n", argv0, errno == EADDRINUSE ? "all privileged ports in use" : strerror(errno));
 		return 1;
 	}
 	
+	lookup_free(&lookup);
+	
+connected:
 	/* Drop privileges */
 	
 	if(setuid(getuid())) {
 		fprintf(stderr, "%s: Unable to drop privileges: %s\n", argv0, strerror(errno));
 		return 1;
 	}
+
+	if(tls && (sock = tls_client(sock, host, verbose)) == -1) {
+		fprintf(stderr, "%s: %s\n", argv0, tls_error());
+		return 1;
+	}
 	
+	/* A master or a batch needs a session, and has no command of its own yet */
+
+	if(masterpath || batchfile) {
+		lport[1] = '0';
+		lport[2] = 0;
+
+		if(!fastopen)
+			len = build_request(buf[0], BUFLEN, lport, luser, user, 0, NULL);
+
+		if(len == -1 || safewrite(sock, buf[0] + sent, len - sent) == -1) {
+			fprintf(stderr, "%s: Unable to send required information: %s\n", argv0, strerror(errno));
+			return 1;
+		}
+
+		phase_done(PHASE_REQUEST);
+
+		if((err = negotiate(sock, compress && batchfile ? FEATURE_SESSION "," FEATURE_DEFLATE : FEATURE_SESSION, offer, sizeof offer)) == -1) {
+			fprintf(stderr, "%s: Didn't receive answer from server: %s\n", argv0, strerror(errno));
+			return 1;
+		}
+
+		phase_done(PHASE_ANSWER);
+		timing.next = PHASE_TRANSFER;
+
+		if(!err || !feature_has(offer, FEATURE_SESSION)) {
+			fprintf(stderr, "%s: Server does not support sessions\n", argv0);
+			return 1;
+		}
+
+		if(batchfile) {
+			if(compress && feature_has(offer, FEATURE_DEFLATE))
+				codec_init(&codec);
+
+			err = batch(sock, batchfile, verbose);
+			phase_done(PHASE_TRANSFER);
+
+			if(verbose)
+				codec_report();
+
+			return err;
+		}
+
+		/* The master itself runs on in the background */
+
+		timing.on = false;
+		return master(sock, masterpath, verbose);
+	}
+
 	/* Send required information to the server */
 	
-	bufp[0] = buf[0];
-	len[0] = sizeof buf[0];
-	safecpy(&bufp[0], &len[0], lport, 1);
-	safecpy(&bufp[0], &len[0], luser, 1);
-	safecpy(&bufp[0], &len[0], user, 1);
-
-	for(; optind < argc; optind++) {
-		safecpy(&bufp[0], &len[0], argv[optind], 0);
-		if(optind < argc - 1)
-			safecpy(&bufp[0], &len[0], " ", 0);
-	}
-	safecpy(&bufp[0], &len[0], "", 1);
-	
-	if(!len[0]) {
+	if(!fastopen && (len = build_request(buf[0], BUFLEN, lport, luser, user, argc - optind, argv + optind)) == -1) {
 		fprintf(stderr, "%s: Arguments too long!\n", argv0);
 		return 1;
 	}
 	
-	if(safewrite(sock, buf[0], bufp[0] - buf[0]) == -1) {
+	if(safewrite(sock, buf[0] + sent, len - sent) == -1) {
 		fprintf(stderr, "%s: Unable to send required information: %s\n", argv0, strerror(errno));
 		return 1;
 	}
 
-	/* Wait for acknowledgement from server */
-	
-	errno = 0;
+	phase_done(PHASE_REQUEST);
+
+	/* Wait for acknowledgement from server. If it can send everything over
+	   this connection, the stderr connection is not needed. */
 	
-	if(read(sock, buf[0], 1) != 1 || *buf[0]) {
+	if((err = negotiate(sock, compress ? FEATURE_MUX "," FEATURE_DEFLATE : FEATURE_MUX, offer, sizeof offer)) == -1) {
 		fprintf(stderr, "%s: Didn't receive NULL byte from server: %s\n", argv0, strerror(errno));
 		return 1;
 	}
 
+	phase_done(PHASE_ANSWER);
+
+	if(err) {
+		close(lsock);
+		timing.next = PHASE_TRANSFER;
+
+		if(compress && feature_has(offer, FEATURE_DEFLATE))
+			codec_init(&codec);
+
+		if((err = relay_frames(sock, NULL, 0)) == -1) {
+			fprintf(stderr, "%s: Connection closed by server\n", argv0);
+			return 1;
+		}
+
+		phase_done(PHASE_TRANSFER);
+
+		if(verbose)
+			codec_report();
+
+		return err;
+	}
+
 	/* Wait for incoming connection from server */
 	
+	if(lsock == -1) {
+		fprintf(stderr, "%s: Server does not support multiplexing\n", argv0);
+		return 1;
+	}
+
 	if((esock = accept(lsock, NULL, 0)) == -1) {
 		fprintf(stderr, "%s: Could not accept stderr connection: %s\n", argv0, strerror(errno));
 		return 1;
 	}
 	
 	close(lsock);
+	phase_done(PHASE_STDERR);
 	
 	/* Process input/output */
 
@@ -357,143 +3944,73 @@ done:
 	flags = fcntl(esock, F_GETFL);
 	fcntl(esock, F_SETFL, flags | O_NONBLOCK);
 	
-	bufp[0] = buf[0];
-	bufp[1] = buf[1];
-	bufp[2] = buf[2];
-	
-	FD_ZERO(&infdset);
-	FD_ZERO(&outfdset);
-	FD_SET(0, &infdset);
-	FD_SET(sock, &infdset);
-	FD_SET(esock, &infdset);
-	
-	maxfd = (sock>esock?sock:esock) + 1;
+	if(!(buf[1] = malloc(BUFLEN)) || !(buf[2] = malloc(BUFLEN))) {
+		fprintf(stderr, "%s: Could not allocate buffers: %s\n", argv0, strerror(errno));
+		return 1;
+	}
+
+	stream_init(&streams[0], 0, sock, buf[0], true);
+	stream_init(&streams[1], sock, 1, buf[1], true);
+	stream_init(&streams[2], esock, 2, buf[2], true);
 	
 	for(;;) {
-		errno = 0;
-		infd = infdset;
-		outfd = outfdset;
-		errfd = infdset;
-	
-		if(select(maxfd, &infd, &outfd, &errfd, NULL) <= 0) {
-			if(errno == EINTR)
-				continue;
-			else
-				break;
-		}
-
-
-		if(FD_ISSET(esock, &infd)) {
-			len[2] = read(esock, buf[2], BUFLEN);
-			if(len[2] <= 0) {
-				if(errno != EINTR && errno != EAGAIN) {
-					if(FD_ISSET(sock, &infdset) || FD_ISSET(1, &outfdset))
-						FD_CLR(esock, &infdset);
-					else
-						break;
-				}
-			} else {
-				FD_SET(2, &outfdset);
-				FD_CLR(esock, &infdset);
-			}
-		} else {
-			len[2] = 0;
-		}
+		/* Retire finished streams, shutting down the socket once stdin is exhausted */
 
-		if(FD_ISSET(2, &outfd)) {
-			wlen = write(2, bufp[2], len[2]);
-			if(wlen <= 0) {
-				if(errno != EINTR && errno != EAGAIN) {
-					if(FD_ISSET(sock, &infdset) || FD_ISSET(1, &outfdset))
-						FD_CLR(esock, &infdset);
-					else
-						break;
-				}
-			} else {
-				len[2] -= wlen;
-				bufp[2] += wlen;
-				if(!len[2]) {
-					FD_CLR(2, &outfdset);
-					FD_SET(esock, &infdset);
-					bufp[2] = buf[2];
-				}
+		for(i = 0; i < 3; i++) {
+			if(!streams[i].done && streams[i].eof && !streams[i].len) {
+				streams[i].done = true;
+				if(i == 0)
+					shutdown(sock, SHUT_WR);
 			}
 		}
 
-		if(FD_ISSET(sock, &infd)) {
-			len[1] = read(sock, buf[1], BUFLEN);
-			if(len[1] <= 0) {
-				if(errno != EINTR && errno != EAGAIN) {
-					if(FD_ISSET(esock, &infdset) || FD_ISSET(2, &outfdset))
-						FD_CLR(sock, &infdset);
-					else
-						break;
-				}
-			} else {
-				FD_SET(1, &outfdset);
-				FD_CLR(sock, &infdset);
-			}
-		}
+		if(streams[1].done && streams[2].done)
+			break;
 
-		if(FD_ISSET(1, &outfd)) {
-			wlen = write(1, bufp[1], len[1]);
-			if(wlen <= 0) {
-				if(errno != EINTR && errno != EAGAIN) {
-					if(FD_ISSET(esock, &infdset) || FD_ISSET(2, &outfdset))
-						FD_CLR(sock, &infdset);
-					else
-						break;
-				}
-			} else {
-				len[1] -= wlen;
-				bufp[1] += wlen;
-				if(!len[1]) {
-					FD_CLR(1, &outfdset);
-					FD_SET(sock, &infdset);
-					bufp[1] = buf[1];
-				}
-			}
+		for(i = 0; i < 3; i++) {
+			pfd[2 * i].fd = stream_wantread(&streams[i]) ? streams[i].in : -1;
+			pfd[2 * i].events = POLLIN;
+			pfd[2 * i + 1].fd = stream_wantwrite(&streams[i]) ? streams[i].out : -1;
+			pfd[2 * i + 1].events = POLLOUT;
 		}
 
-		if(FD_ISSET(0, &infd)) {
-			len[0] = read(0, buf[0], BUFLEN);
-			if(len[0] <= 0) {
-				if(errno != EINTR && errno != EAGAIN) {
-					FD_CLR(0, &infdset);
-					shutdown(sock, SHUT_WR);
-				}
-			} else {
-				FD_SET(sock, &outfdset);
-				FD_CLR(0, &infdset);
-			}
+		if(poll(pfd, 6, -1) == -1) {
+			if(errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: poll() failed: %s\n", argv0, strerror(errno));
+			return 1;
 		}
 
-		if(FD_ISSET(sock, &outfd)) {
-			wlen = write(sock, bufp[0], len[0]);
-			if(wlen <= 0) {
-				if(errno != EINTR && errno != EAGAIN)
-					break;
-			} else {
-				len[0] -= wlen;
-				bufp[0] += wlen;
-				if(!len[0]) {
-					FD_CLR(sock, &outfdset);
-					FD_SET(0, &infdset);
-					bufp[0] = buf[0];
-				}
-			}
+		for(i = 0; i < 3; i++) {
+			if(pfd[2 * i].fd != -1 && pfd[2 * i].revents)
+				stream_read(&streams[i]);
+			if(pfd[2 * i + 1].fd != -1 && pfd[2 * i + 1].revents)
+				stream_write(&streams[i]);
 		}
+	}
 
-		
+	for(i = 0; i < 3; i++) {
+		stream_free(&streams[i]);
+		timing.bytes[i] = streams[i].bytes;
 	}
-		
-	if(errno) {
-		fprintf(stderr, "%s: %s\n", argv0, strerror(errno));
-		return 1;
+	
+	for(i = 0; i < 3; i++) {
+		if(streams[i].error) {
+			fprintf(stderr, "%s: %s\n", argv0, strerror(streams[i].error));
+			return 1;
+		}
 	}
 	
+	phase_done(PHASE_TRANSFER);
 	close(sock);
 	close(esock);
 	
 	return 0;
 }
+
+int main(int argc, char **argv) {
+	int status = rsh(argc, argv);
+
+	report(status);
+	return status;
+}
@@ -19,12 +19,17 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <pwd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/poll.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <string.h>
 #include <errno.h>
@@ -36,11 +41,33 @@
 #include <utmp.h>
 #include <grp.h>
 #include <paths.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#include "connect.h"
+#include "protocol.h"
+#include "tls.h"
 
 static char *argv0;
 
+/* Bulk transfer settings, and whether the socket is corked until the session starts */
+
+static struct tuning tuning;
+static bool bulk;
+static bool corked;
+
+/* Run as in.rexecd, the client sends a password instead of using a
+   privileged port, and hears about a failure before the NULL byte */
+
+static bool rexecd;
+static bool answered;
+
+/* Certificate and key for clients that start with a TLS handshake */
+
+static char *certfile;
+
 static void usage(void) {
-	syslog(LOG_NOTICE, "Usage: %s", argv0);
+	syslog(LOG_NOTICE, "Usage: %s [-b[settings]] [-c certfile] [-L port]", argv0);
 }
 
 /* Read until a NULL byte is encountered */
@@ -65,11 +92,707 @@ static ssize_t readtonull(int fd, char *buf, size_t count) {
 	return -1;
 }
 
-/* PAM conversation function */
+/* Connect back to the client for stderr */
+
+static bool connect_stderr(struct sockaddr *peer, const char *addr, const char *host, const char *eport) {
+	struct addrinfo hint, *ai;
+	int esock = -1, err = 0, i;
+
+	memset(&hint, '\0', sizeof hint);
+	hint.ai_socktype = SOCK_STREAM;
+	hint.ai_family = peer->sa_family;
+	
+	err = getaddrinfo(addr, eport, &hint, &ai);
+	if(err || !ai) {
+		syslog(LOG_ERR, "Error looking up host: %s", gai_strerror(err));
+		return false;
+	}
+
+	/* Retry with another port if the previous one still has a
+	   connection to the same address lingering around */
+
+	for(i = 0; i < 16; i++) {
+		esock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	
+		if(esock == -1) {
+			syslog(LOG_ERR, "socket() failed: %m");
+			return false;
+		}
+
+		if(!rexecd && bindresvport_af(esock, ai->ai_family, true) == -1) {
+			syslog(LOG_ERR, "Could not bind to privileged port: %m");
+			return false;
+		}
+	
+		if(!(err = connect(esock, ai->ai_addr, ai->ai_addrlen)) || errno != EADDRNOTAVAIL)
+			break;
+
+		close(esock);
+	}
+
+	if(err) {
+		syslog(LOG_ERR, "Connecting to stderr port %d on %s failed: %m", atoi(eport), host);
+		return false;
+	}
+	
+	freeaddrinfo(ai);
+	
+	if(esock != 2) {
+		if(dup2(esock, 2) == -1) {
+			syslog(LOG_ERR, "dup2() failed: %m");
+			return false;
+		}
+		close(esock);
+	}
+
+	return true;
+}
+
+/* Tell the client what went wrong, in the form it expects */
+
+static void tell(bool framed, const char *message) {
+	struct framebuf *b;
+
+	if(rexecd && !answered) {
+		write(1, "\001", 1);
+		write(1, message, strlen(message));
+		return;
+	}
+
+	if(!framed) {
+		write(1, message, strlen(message));
+		return;
+	}
+
+	if(!(b = calloc(1, sizeof *b)))
+		return;
+
+	frame_put(b, FRAME_STDERR, 0, message, strlen(message));
+	while(b->len && framebuf_write(1, b) > 0);
+	free(b);
+}
+
+/* Running commands for a client that uses framing.
+   The standard input, output and error of each command are pipes, which are
+   relayed to and from frames on the connection with the client. When a
+   command's input pipe is full, its STDIN frame is left at the head of the
+   input buffer, which holds up the frames for other channels until the
+   command has read its input.
+   A command for a channel that is still in use is queued together with the
+   input that follows it, and started when the previous one has exited. */
+
+struct child {
+	pid_t pid;
+	int in, out, err;
+	bool exited;
+	int status;
+	char *queued;
+	char *qbuf;
+	int qlen, qoff;
+	bool qeof;
+};
+
+/* How much input is kept for a queued command before it holds up the others */
+
+#define QUEUE_MAX (4 * FRAME_MAX)
+
+static struct child children[CHANNELS];
+static int nchildren;
+
+static bool child_start(int chan, const char *command, const char *shell, char **env) {
+	struct child *c = &children[chan];
+	int in[2], out[2], err[2];
+	const char *shellname;
+	sigset_t mask;
+
+	if(pipe2(in, O_CLOEXEC))
+		return false;
+
+	if(pipe2(out, O_CLOEXEC)) {
+		close(in[0]);
+		close(in[1]);
+		return false;
+	}
+
+	if(pipe2(err, O_CLOEXEC)) {
+		close(in[0]);
+		close(in[1]);
+		close(out[0]);
+		close(out[1]);
+		return false;
+	}
+
+	c->pid = fork();
+
+	if(!c->pid) {
+		dup2(in[0], 0);
+		dup2(out[1], 1);
+		dup2(err[1], 2);
+
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+
+		shellname = strrchr(shell, '/');
+		if(shellname)
+			shellname++;
+		else
+			shellname = shell;
+
+		execle(shell, shellname, "-c", command, NULL, env);
+
+		syslog(LOG_ERR, "Failed to spawn shell: %m");
+		_exit(1);
+	}
+
+	close(in[0]);
+	close(out[1]);
+	close(err[1]);
+
+	if(c->pid == -1) {
+		close(in[1]);
+		close(out[0]);
+		close(err[0]);
+		return false;
+	}
+
+	c->in = in[1];
+	c->out = out[0];
+	c->err = err[0];
+	c->exited = false;
+	fcntl(c->in, F_SETFL, O_NONBLOCK);
+	fcntl(c->out, F_SETFL, O_NONBLOCK);
+	fcntl(c->err, F_SETFL, O_NONBLOCK);
+
+	/* Let the command get ahead of us by a full frame or more */
+
+	if(fcntl(c->out, F_GETPIPE_SZ) < 4 * FRAME_MAX)
+		fcntl(c->out, F_SETPIPE_SZ, 4 * FRAME_MAX);
+	nchildren++;
+
+	return true;
+}
+
+static void child_closein(struct child *c) {
+	if(c->in != -1)
+		close(c->in);
+	c->in = -1;
+}
+
+/* Input for a command that didn't fit in its pipe yet */
+
+static struct child *pending;
+static char pendbuf[FRAME_MAX];
+static int pendlen;
+
+static struct codec codec;
+
+/* Write input to a command, keeping what doesn't fit for later.
+   Returns false if the rest of the input has to wait. */
+
+static bool child_write(struct child *c, const char *data, int len) {
+	int result = write(c->in, data, len);
+
+	if(result == -1) {
+		if(errno != EAGAIN && errno != EINTR) {
+			/* The command doesn't want any more input */
+			child_closein(c);
+			return true;
+		}
+		result = 0;
+	}
+
+	if(result == len)
+		return true;
+
+	memmove(pendbuf, data + result, len - result);
+	pendlen = len - result;
+	pending = c;
+	return false;
+}
+
+/* Keep input for a command that hasn't started yet.
+   Returns false if there is no room for it yet. */
+
+static bool child_queue(struct child *c, const char *data, int len) {
+	char *buf;
+
+	if(!len) {
+		c->qeof = true;
+		return true;
+	}
+
+	if(c->qlen + len > QUEUE_MAX)
+		return false;
+
+	if(!(buf = realloc(c->qbuf, c->qlen + len)))
+		return false;
+
+	memcpy(buf + c->qlen, data, len);
+	c->qbuf = buf;
+	c->qlen += len;
+	return true;
+}
+
+/* Pass the queued input on to a command that has started */
+
+static void child_flush(struct child *c) {
+	int result;
+
+	while(c->in != -1 && c->qoff < c->qlen) {
+		result = write(c->in, c->qbuf + c->qoff, c->qlen - c->qoff);
+
+		if(result == -1) {
+			if(errno == EAGAIN || errno == EINTR)
+				return;
+			child_closein(c);
+			break;
+		}
+
+		c->qoff += result;
+	}
+
+	free(c->qbuf);
+	c->qbuf = NULL;
+	c->qlen = c->qoff = 0;
+
+	if(c->qeof)
+		child_closein(c);
+	c->qeof = false;
+}
+
+/* Start the command that was waiting for the channel */
+
+static void child_dequeue(int chan, struct framebuf *out, const char *shell, char **env) {
+	struct child *c = &children[chan];
+	char *command = c->queued;
+
+	c->queued = NULL;
+
+	if(!child_start(chan, command, shell, env)) {
+		syslog(LOG_ERR, "Could not start command: %m");
+		c->pid = 0;
+		frame_put(out, FRAME_EXIT, chan, "\001", 1);
+		free(c->qbuf);
+		c->qbuf = NULL;
+		c->qlen = c->qoff = 0;
+		c->qeof = false;
+	} else {
+		child_flush(c);
+	}
+
+	free(command);
+}
+
+/* Handle the frames from the client. Returns false on a protocol error. */
+
+static bool process(struct framebuf *in, struct framebuf *out, bool session, const char *shell, char **env, struct child **stalled) {
+	struct frame f;
+	struct child *c;
+	char command[FRAME_MAX + 1];
+	char *data;
+	int result, len;
+
+	/* First finish the input that was held up */
+
+	if(pending) {
+		c = pending;
+		pending = NULL;
+
+		if(c->pid && c->in != -1 && !child_write(c, pendbuf, pendlen)) {
+			*stalled = c;
+			return true;
+		}
+	}
+
+	*stalled = NULL;
+
+	while((result = frame_peek(in, &f)) == 1) {
+		c = &children[f.chan];
+
+		switch(f.type & ~FRAME_DEFLATE) {
+			case FRAME_EXEC:
+				if(!session) {
+					syslog(LOG_ERR, "Unexpected command for channel %d", f.chan);
+					return false;
+				}
+
+				memcpy(command, f.data, f.len);
+				command[f.len] = 0;
+
+				/* Commands on the same channel run one after another,
+				   the next one waits until the previous one has exited */
+
+				if(c->pid) {
+					if(c->queued) {
+						syslog(LOG_ERR, "Too many commands for channel %d", f.chan);
+						return false;
+					}
+
+					if(!(c->queued = strdup(command))) {
+						syslog(LOG_ERR, "Could not queue command: %m");
+						return false;
+					}
+					break;
+				}
+
+				if(!child_start(f.chan, command, shell, env)) {
+					syslog(LOG_ERR, "Could not start command: %m");
+					c->pid = 0;
+					frame_put(out, FRAME_EXIT, f.chan, "\001", 1);
+				}
+				break;
+
+			case FRAME_STDIN:
+				if((len = frame_data(&codec, &f, &data)) == -1) {
+					syslog(LOG_ERR, "Invalid input for channel %d", f.chan);
+					return false;
+				}
+
+				/* Input for a queued command, or for one that
+				   hasn't had all of its queued input yet */
+
+				if(c->queued || c->qlen) {
+					if(!child_queue(c, data, len))
+						return true;
+					break;
+				}
+
+				if(!c->pid || c->in == -1)
+					break;
+
+				if(!len) {
+					child_closein(c);
+					break;
+				}
+
+				if(!child_write(c, data, len)) {
+					frame_next(in, &f);
+					*stalled = c;
+					return true;
+				}
+				break;
+
+			default:
+				syslog(LOG_ERR, "Unexpected frame type %d", f.type);
+				return false;
+		}
+
+		frame_next(in, &f);
+	}
+
+	return result != -1;
+}
+
+/* Move output from a command's pipe into a frame. Returns false at the end of the output. */
+
+static bool relay_output(int *fd, struct framebuf *out, int type, int chan) {
+	char *data;
+	int len, result;
+
+	/* Without compression, read straight into the frame */
+
+	if(codec.on) {
+		data = codec.buf;
+		len = CODEC_MAX;
+		if(!frame_canput(out, &codec))
+			return true;
+	} else if(!(data = frame_reserve(out, &len))) {
+		return true;
+	}
+
+	result = read(*fd, data, len);
+
+	if(result > 0) {
+		if(codec.on)
+			frame_put_data(out, &codec, type, chan, data, result);
+		else
+			frame_commit(out, type, chan, result);
+		return true;
+	}
+
+	if(result == -1 && (errno == EAGAIN || errno == EINTR))
+		return true;
+
+	frame_put(out, type, chan, NULL, 0);
+	close(*fd);
+	*fd = -1;
+	return false;
+}
+
+static int serve(const char *command, const char *shell, char **env) {
+	static struct framebuf in, out;
+	bool selected = false, session = false;
+	char *features;
+	struct pollfd pfd[2 + 3 * CHANNELS];
+	struct child *c, *stalled = NULL;
+	struct signalfd_siginfo si;
+	char status;
+	sigset_t mask;
+	bool eof = false;
+	int sigfd, npfd, chan, wstatus, result, one = 1, i, early = 0, len;
+	pid_t pid;
+
+	/* Get notified about exiting commands through a file descriptor */
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if((sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+		syslog(LOG_ERR, "signalfd() failed: %m");
+		return 1;
+	}
+
+	/* Frames are already collected in a buffer, don't delay them any further */
+
+	setsockopt(0, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	fcntl(0, F_SETFL, fcntl(0, F_GETFL) | O_NONBLOCK);
+
+	frame_put(&out, FRAME_READY, 0, NULL, 0);
+
+	/* Don't wait for the client to tell us what it wants before starting the
+	   command, with an empty command we have to know if it wants a session */
+
+	if(*command && !child_start(0, command, shell, env)) {
+		syslog(LOG_ERR, "Could not start command: %m");
+		return 1;
+	}
+
+	for(;;) {
+		/* The features the client wants come before any frames */
+
+		if(!selected && (features = framebuf_getstr(&in))) {
+			selected = true;
+			session = feature_has(features, FEATURE_SESSION);
+
+			if(feature_has(features, FEATURE_DEFLATE) && !codec_init(&codec))
+				syslog(LOG_WARNING, "Could not initialize compression, sending data uncompressed");
+
+			if(!*command && !session && !child_start(0, command, shell, env)) {
+				syslog(LOG_ERR, "Could not start command: %m");
+				return 1;
+			}
+		}
+
+		if(!selected && !framebuf_room(&in)) {
+			syslog(LOG_ERR, "Invalid features from client");
+			break;
+		}
+
+		/* Pass on queued input for commands that have started */
+
+		for(chan = 0; chan < CHANNELS; chan++)
+			if(children[chan].pid && !children[chan].queued && children[chan].qlen)
+				child_flush(&children[chan]);
+
+		/* Handle whatever frames we can */
+
+		if(selected && !process(&in, &out, session, shell, env, &stalled))
+			break;
+
+		/* Report commands that have finished */
+
+		for(chan = 0; chan < CHANNELS; chan++) {
+			c = &children[chan];
+
+			if(!c->pid || !c->exited || c->out != -1 || c->err != -1)
+				continue;
+
+			if(WIFSIGNALED(c->status))
+				status = 128 + WTERMSIG(c->status);
+			else
+				status = WEXITSTATUS(c->status);
+
+			if(!frame_put(&out, FRAME_EXIT, chan, &status, 1))
+				break;
+
+			child_closein(c);
+			c->pid = 0;
+			nchildren--;
+
+			if(pending == c)
+				pending = NULL;
+
+			if(c->queued)
+				child_dequeue(chan, &out, shell, env);
+		}
+
+		/* Without a session, we are done when the command is */
+
+		if(selected && !session && !children[0].pid)
+			eof = true;
+
+		if(eof && !nchildren && !out.len)
+			break;
+
+		/* Wait for something to happen */
+
+		pfd[0].events = (eof || !framebuf_room(&in) ? 0 : POLLIN) | (out.len ? POLLOUT : 0);
+		pfd[0].fd = pfd[0].events ? 0 : -1;
+		pfd[1].fd = sigfd;
+		pfd[1].events = POLLIN;
+		npfd = 2;
+
+		for(chan = 0; chan < CHANNELS; chan++) {
+			c = &children[chan];
+
+			if(!c->pid)
+				continue;
+
+			pfd[npfd].fd = c == stalled || (c->qlen && !c->queued) ? c->in : -1;
+			pfd[npfd++].events = POLLOUT;
+			pfd[npfd].fd = c->out;
+			pfd[npfd++].events = POLLIN;
+			pfd[npfd].fd = c->err;
+			pfd[npfd++].events = POLLIN;
+		}
+
+		/* Don't read more output than we can send. Until we know whether the
+		   client wants compression, only send a little, so a large output
+		   doesn't go out uncompressed just because the answer was slow. */
+
+		if(!frame_canput(&out, &codec) || (!selected && early >= FRAME_MAX))
+			for(i = 2; i < npfd; i++)
+				pfd[i].events &= ~POLLIN;
+
+		if(poll(pfd, npfd, -1) == -1) {
+			if(errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "poll() failed: %m");
+			break;
+		}
+
+		if(pfd[0].revents & POLLOUT) {
+			if(framebuf_write(0, &out) == -1 && errno != EAGAIN && errno != EINTR)
+				break;
+
+			if(corked) {
+				tuning_cork(0, false);
+				corked = false;
+			}
+		}
+
+		if(pfd[0].events & POLLIN && pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+			result = framebuf_read(0, &in);
+
+			if(!result)
+				eof = true;
+			else if(result == -1 && errno != EAGAIN && errno != EINTR)
+				break;
+		}
+
+		if(pfd[1].revents) {
+			while(read(sigfd, &si, sizeof si) > 0);
+
+			while((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+				for(chan = 0; chan < CHANNELS; chan++) {
+					if(children[chan].pid == pid) {
+						children[chan].exited = true;
+						children[chan].status = wstatus;
+						break;
+					}
+				}
+			}
+		}
+
+		len = out.len;
+
+		for(npfd = 2, chan = 0; chan < CHANNELS; chan++) {
+			c = &children[chan];
+
+			if(!c->pid)
+				continue;
+
+			if(pfd[npfd + 1].revents)
+				relay_output(&c->out, &out, FRAME_STDOUT, chan);
+			if(pfd[npfd + 2].revents)
+				relay_output(&c->err, &out, FRAME_STDERR, chan);
+
+			npfd += 3;
+		}
+
+		if(!selected)
+			early += out.len - len;
+	}
+
+	if(codec.on)
+		syslog(LOG_INFO, "Compressed %llu bytes of output to %llu, %llu bytes of input from %llu", codec.rawout, codec.wireout, codec.rawin, codec.wirein);
+
+	/* If the client went away, so do the commands */
+
+	for(chan = 0; chan < CHANNELS; chan++)
+		if(children[chan].pid && !children[chan].exited)
+			kill(children[chan].pid, SIGHUP);
+
+	return eof && !nchildren ? 0 : 1;
+}
+
+/* Write NULL byte to client so we can give a login prompt if necessary,
+   or offer the extensions if the client knows about them */
+
+static bool answer(bool extended) {
+	static const char offer[] = PROTO_OFFER FEATURES;
+
+	answered = true;
+
+	if(!extended) {
+		if(write(1, "", 1) <= 0) {
+			syslog(LOG_ERR, "Unable to write NULL byte: %m");
+			return false;
+		}
+
+		return true;
+	}
+
+	/* Send the offer together with the start of the session */
+
+	if(bulk) {
+		tuning_cork(1, true);
+		corked = true;
+	}
+
+	if(write(1, offer, sizeof offer) <= 0) {
+		syslog(LOG_ERR, "Unable to offer extensions: %m");
+		return false;
+	}
+
+	return true;
+}
+
+/* PAM conversation function. Only rexec has an answer, the password. */
 
 static int conv_h(int msgc, const struct pam_message **msgv, struct pam_response **res, void *app) {
-	syslog(LOG_ERR, "PAM requires conversation");
-	return PAM_CONV_ERR;
+	struct pam_response *r;
+	int i;
+
+	if(!app) {
+		syslog(LOG_ERR, "PAM requires conversation");
+		return PAM_CONV_ERR;
+	}
+
+	if(!(r = calloc(msgc, sizeof *r)))
+		return PAM_BUF_ERR;
+
+	for(i = 0; i < msgc; i++) {
+		switch(msgv[i]->msg_style) {
+			case PAM_PROMPT_ECHO_OFF:
+				if((r[i].resp = strdup(app)))
+					break;
+				/* Fall through */
+			case PAM_PROMPT_ECHO_ON:
+				while(i--)
+					free(r[i].resp);
+				free(r);
+				syslog(LOG_ERR, "PAM requires conversation");
+				return PAM_CONV_ERR;
+			default:
+				break;
+		}
+	}
+
+	*res = r;
+	return PAM_SUCCESS;
 }
 
 int main(int argc, char **argv) {
@@ -79,6 +802,7 @@ int main(int argc, char **argv) {
 	
 	char user[1024];
 	char luser[1024];
+	char password[1024];
 	char command[1024];
 	char env[1024];
 		
@@ -92,13 +816,12 @@ int main(int argc, char **argv) {
 	char addr[NI_MAXHOST];
 	char port[NI_MAXSERV];
 	char eport[NI_MAXSERV];
-	char lport[NI_MAXSERV];
 	int portnr, eportnr;
-	
-	struct addrinfo hint, *ai, *lai;
-	int esock;
-		
-	int i;
+
+	bool extended;
+	bool local = false;
+	bool tls = false;
+	int fd;
 
 	pam_handle_t *handle;		
 	struct pam_conv conv = {conv_h, NULL};
@@ -108,11 +831,29 @@ int main(int argc, char **argv) {
 	char *shellname;
 	
 	argv0 = argv[0];
+	rexecd = !strcmp(basename(argv0), "in.rexecd");
 	
 	/* Process options */
 			
-	while((opt = getopt(argc, argv, "+")) != -1) {
+	while((opt = getopt(argc, argv, "+b::c:L:")) != -1) {
 		switch(opt) {
+			case 'b':
+				if(!tuning_parse(&tuning, optarg)) {
+					syslog(LOG_ERR, "Invalid bulk transfer settings: %s", optarg);
+					return 1;
+				}
+				bulk = true;
+				break;
+			case 'c':
+				if(!tls_server_init(optarg)) {
+					syslog(LOG_ERR, "%s", tls_error());
+					return 1;
+				}
+				certfile = optarg;
+				break;
+			case 'L':
+				serve_standalone(optarg);
+				break;
 			default:
 				syslog(LOG_ERR, "Unknown option!");
 				usage();
@@ -133,34 +874,67 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 	
-	/* Unmap V4MAPPED addresses */
+	/* A client on this host, the kernel tells us who it is, see peer_allowed() */
+
+	if(peer->sa_family == AF_UNIX) {
+		local = true;
+		strcpy(host, "localhost");
+		strcpy(addr, "localhost");
+	} else {
+		if(bulk) {
+			if(!tuning_apply(0, &tuning))
+				syslog(LOG_WARNING, "Could not select congestion control %s: %m", tuning.congestion);
+
+			syslog(LOG_INFO, "Round trip time %.1f ms, send buffer %d, receive buffer %d", tuning.rttus / 1e3, tuning.sndbuf, tuning.rcvbuf);
+		}
+
+		/* Unmap V4MAPPED addresses */
 	
-	if(peer->sa_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&((struct sockaddr_in6 *)peer)->sin6_addr)) {
-		((struct sockaddr_in *)peer)->sin_addr.s_addr = ((struct sockaddr_in6 *)peer)->sin6_addr.s6_addr32[3];
-		peer->sa_family = AF_INET;
-	}
+		if(peer->sa_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&((struct sockaddr_in6 *)peer)->sin6_addr)) {
+			((struct sockaddr_in *)peer)->sin_addr.s_addr = ((struct sockaddr_in6 *)peer)->sin6_addr.s6_addr32[3];
+			peer->sa_family = AF_INET;
+		}
 
-	/* Lookup hostname */
+		/* Lookup hostname */
 	
-	if((err = getnameinfo(peer, peerlen, host, sizeof host, NULL, 0, 0))) {
-		syslog(LOG_ERR, "Error resolving address: %s", gai_strerror(err));
-		return 1;
-	}
+		if((err = getnameinfo(peer, peerlen, host, sizeof host, NULL, 0, 0))) {
+			syslog(LOG_ERR, "Error resolving address: %s", gai_strerror(err));
+			return 1;
+		}
 	
-	if((err = getnameinfo(peer, peerlen, addr, sizeof addr, port, sizeof port, NI_NUMERICHOST | NI_NUMERICSERV))) {
-		syslog(LOG_ERR, "Error resolving address: %s", gai_strerror(err));
-		return 1;
-	}
+		if((err = getnameinfo(peer, peerlen, addr, sizeof addr, port, sizeof port, NI_NUMERICHOST | NI_NUMERICSERV))) {
+			syslog(LOG_ERR, "Error resolving address: %s", gai_strerror(err));
+			return 1;
+		}
 	
-	/* Check if connection comes from a privileged port */
+		/* Check if connection comes from a privileged port */
 	
-	portnr = atoi(port);
+		portnr = atoi(port);
 	
-	if(portnr < 512 || portnr >= 1024) {
-		syslog(LOG_ERR, "Connection from %s on illegal port %d.", host, portnr);
-		return 1;
+		if(!rexecd && !RESVPORT(portnr)) {
+			syslog(LOG_ERR, "Connection from %s on illegal port %d.", host, portnr);
+			return 1;
+		}
 	}
 	
+	/* A client that starts with a TLS handshake instead of a request */
+
+	if(certfile && !local && tls_hello(0)) {
+		if((fd = tls_server(0)) == -1) {
+			syslog(LOG_ERR, "TLS with %s failed: %s", host, tls_error());
+			return 1;
+		}
+
+		if(fd != 0) {
+			dup2(fd, 0);
+			dup2(fd, 1);
+			dup2(fd, 2);
+			close(fd);
+		}
+
+		tls = true;
+	}
+
 	/* Read port number for stderr socket */
 	
 	if(readtonull(0, eport, sizeof eport) <= 0) {
@@ -169,69 +943,32 @@ int main(int argc, char **argv) {
 	}
 	
 	eportnr = atoi(eport);
-	
-	if(eportnr) {
-		memset(&hint, '\0', sizeof hint);
-		hint.ai_socktype = SOCK_STREAM;
-		hint.ai_family = peer->sa_family;
-		
-		err = getaddrinfo(addr, eport, &hint, &ai);
-		if(err || !ai) {
-			syslog(LOG_ERR, "Error looking up host: %s", gai_strerror(err));
-			return 1;
-		}
 
-		esock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-		
-		if(esock == -1) {
-			syslog(LOG_ERR, "socket() failed: %m");
-			return 1;
-		}
+	/* A leading zero means the client knows about the protocol extensions,
+	   and doesn't need a separate connection for stderr */
 
-		hint.ai_flags = AI_PASSIVE;
-		
-		for(i = 1023; i >= 512; i--) {
-			snprintf(lport, sizeof lport, "%d", i);
-			err = getaddrinfo(NULL, lport, &hint, &lai);
-			if(err || !ai) {
-				syslog(LOG_ERR, "Error looking up localhost: %s", gai_strerror(err));
-				return 1;
-			}
-			
-			err = bind(esock, lai->ai_addr, lai->ai_addrlen);
-			
-			freeaddrinfo(lai);
-			
-			if(err)
-				continue;
-			else
-				break;
-		}
-		
-		if(err) {
-			syslog(LOG_ERR, "Could not bind to privileged port: %m");
-			return 1;
-		}
-		
-		if(connect(esock, ai->ai_addr, ai->ai_addrlen)) {
-			syslog(LOG_ERR, "Connecting to stderr port %d on %s failed: %m", eportnr, host);
-			return 1;
-		}
-		
-		freeaddrinfo(ai);
-		
-		if(esock != 2) {
-			if(dup2(esock, 2) == -1) {
-				syslog(LOG_ERR, "dup2() failed: %m");
-				return 1;
-			}
-			close(esock);
-		}
+	extended = eport[0] == PROTO_MARK && eport[1];
+
+	/* A separate connection for stderr would not be encrypted */
+
+	if(tls && eportnr && !extended) {
+		syslog(LOG_ERR, "Client from %s wants stderr outside of TLS", host);
+		return 1;
 	}
 
-	/* Read usernames and terminal info */
+	/* We can't connect back to a unix socket, stderr goes over the same one */
+
+	if(eportnr && !extended && !local && !connect_stderr(peer, addr, host, eport))
+		return 1;
+
+	/* Read usernames, or the username and password for rexec */
 	
-	if(readtonull(0, user, sizeof user) <= 0 || readtonull(0, luser, sizeof luser) <= 0) {
+	if(rexecd) {
+		if(readtonull(0, luser, sizeof luser) <= 0 || readtonull(0, password, sizeof password) <= 0) {
+			syslog(LOG_ERR, "Error while receiving username and password from %s: %m", host);
+			return 1;
+		}
+	} else if(readtonull(0, user, sizeof user) <= 0 || readtonull(0, luser, sizeof luser) <= 0) {
 		syslog(LOG_ERR, "Error while receiving usernames from %s: %m", host);
 		return 1;
 	}
@@ -240,42 +977,59 @@ int main(int argc, char **argv) {
 		syslog(LOG_ERR, "Error while receiving command from %s: %m", host);
 		return 1;
 	}
+
+	if(local && !rexecd && !peer_allowed(0, user)) {
+		syslog(LOG_ERR, "Connection from a local process that is not %s", user);
+		return 1;
+	}
 	
-	syslog(LOG_NOTICE, "Connection from %s@%s for %s", user, host, luser);
+	if(rexecd)
+		syslog(LOG_NOTICE, "Connection from %s for %s", host, luser);
+	else
+		syslog(LOG_NOTICE, "Connection from %s@%s for %s", user, host, luser);
 	
 	/* Start PAM */
 	
-	if((err = pam_start("rsh", luser, &conv, &handle)) != PAM_SUCCESS) {
-		write(1, "Authentication failure\n", 23);
+	if(rexecd)
+		conv.appdata_ptr = password;
+
+	if((err = pam_start(rexecd ? "rexec" : "rsh", luser, &conv, &handle)) != PAM_SUCCESS) {
+		tell(extended, "Authentication failure\n");
 		syslog(LOG_ERR, "PAM error: %s", pam_strerror(handle, err));
 		return 1;
 	}
 		
 	pam_set_item(handle, PAM_USER, luser);
-	pam_set_item(handle, PAM_RUSER, user);
+	if(!rexecd)
+		pam_set_item(handle, PAM_RUSER, user);
 	pam_set_item(handle, PAM_RHOST, host);
 
-	/* Write NULL byte to client so we can give a login prompt if necessary */
-	
-	if(write(1, "", 1) <= 0) {
-		syslog(LOG_ERR, "Unable to write NULL byte: %m");
+	/* rexec can only tell about a failure before the NULL byte */
+
+	if(!rexecd && !answer(extended))
 		return 1;
-	}
 	
 	/* Try to authenticate */
 	
 	err = pam_authenticate(handle, 0);
+	explicit_bzero(password, sizeof password);
 	
-	/* PAM might ask for a new password */
+	/* PAM might ask for a new password. rexec has no way to ask the user
+	   for one, so an expired password is just a failure. */
 	
-	if(err == PAM_NEW_AUTHTOK_REQD) {
+	if(err == PAM_NEW_AUTHTOK_REQD && !rexecd) {
 		err = pam_chauthtok(handle, PAM_CHANGE_EXPIRED_AUTHTOK);
 		if(err == PAM_SUCCESS)
 			err = pam_authenticate(handle, 0);
 	}
 	
 	if(err != PAM_SUCCESS) {
-		write(1, "Authentication failure\n", 23);
+		/* Don't make guessing passwords too easy */
+
+		if(rexecd)
+			sleep(1);
+
+		tell(extended, "Authentication failure\n");
 		syslog(LOG_ERR, "PAM error: %s", pam_strerror(handle, err));
 		return 1;
 	}
@@ -285,11 +1039,14 @@ int main(int argc, char **argv) {
 	err = pam_acct_mgmt(handle, 0);
 	
 	if(err != PAM_SUCCESS) {
-		write(1, "Authentication failure\n", 23);
+		tell(extended, "Authentication failure\n");
 		syslog(LOG_ERR, "PAM error: %s", pam_strerror(handle, err));
 		return 1;
 	}
 
+	if(rexecd && !answer(extended))
+		return 1;
+
 	/* PAM can map the user to a different user */
 	
 	err = pam_get_item(handle, PAM_USER, &item);
@@ -312,16 +1069,24 @@ int main(int argc, char **argv) {
 		syslog(LOG_ERR, "PAM_USER does not exist?!");
 		return 1;
 	}
+
+#ifdef TESTMODE
+	/* Don't let the user's shell startup files skew measurements */
+
+	pw->pw_shell = "/bin/sh";
+#endif
 	
 	if (setgid(pw->pw_gid)) {
 		syslog(LOG_ERR, "setgid() failed: %m");
 		return 1;
 	}
 	
+#ifndef TESTMODE
 	if (initgroups(pamuser, pw->pw_gid)) {
 		syslog(LOG_ERR, "initgroups() failed: %m");
 		return 1;
 	}
+#endif
 	
 	err = pam_setcred(handle, PAM_ESTABLISH_CRED);
 	
@@ -366,6 +1131,9 @@ int main(int argc, char **argv) {
 	else
 		shellname = pw->pw_shell;				
 	
+	if(extended)
+		return serve(command, pw->pw_shell, pam_getenvlist(handle));
+
 	if(strrchr(pw->pw_shell, '/'))
 	
 	execle(pw->pw_shell, shellname, "-c", command, NULL, pam_getenvlist(handle));
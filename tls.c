@@ -0,0 +1,337 @@
+/*
+    tls.c - encrypted connections, with the encryption done by the kernel
+    Copyright (C) 2026  agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include "tls.h"
+
+#define RECORD 16384		/* The most a TLS record holds */
+
+static char error[256];
+static SSL_CTX *server;
+
+const char *tls_error(void) {
+	return error;
+}
+
+static void tls_fail(const char *what) {
+	unsigned long err = ERR_get_error();
+
+	if(err)
+		snprintf(error, sizeof error, "%s: %s", what, ERR_reason_error_string(err));
+	else
+		snprintf(error, sizeof error, "%s", what);
+
+	ERR_clear_error();
+}
+
+/* The kernel can take over both directions of a TLS 1.2 connection with
+   AES-GCM, with any version of OpenSSL that knows about kTLS, so only that
+   is used. Nothing in the protocol needs renegotiation or session tickets,
+   and they would only get in the way once the kernel has the keys. */
+
+static SSL_CTX *tls_context(const SSL_METHOD *method) {
+	SSL_CTX *ctx = SSL_CTX_new(method);
+
+	if(!ctx)
+		return NULL;
+
+	if(!SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION)
+			|| !SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION)
+			|| !SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM")) {
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_NO_TICKET | SSL_OP_IGNORE_UNEXPECTED_EOF);
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	return ctx;
+}
+
+/* Move data between the application on fd, and the other side through
+   ssl, until both directions have ended. An end of input from either side
+   is passed on as a shutdown of the other, just like a plain connection. */
+
+static void relay(SSL *ssl, int sock, int fd) {
+	char in[RECORD], out[RECORD];
+	int inoff = 0, inlen = 0, outoff = 0, outlen = 0, result;
+	bool ineof = false, outeof = false;
+	struct pollfd pfd[2];
+
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	for(;;) {
+		pfd[0].fd = sock;
+		pfd[0].events = 0;
+		pfd[1].fd = fd;
+		pfd[1].events = 0;
+
+		/* From the application to the other side */
+
+		if(!inlen && !ineof) {
+			result = read(fd, in, sizeof in);
+
+			if(result > 0) {
+				inoff = 0;
+				inlen = result;
+			} else if(!result) {
+				ineof = true;
+				shutdown(sock, SHUT_WR);
+			} else if(errno == EAGAIN || errno == EINTR) {
+				pfd[1].events |= POLLIN;
+			} else {
+				return;
+			}
+		}
+
+		if(inlen) {
+			if((result = SSL_write(ssl, in + inoff, inlen)) > 0) {
+				inoff += result;
+				inlen -= result;
+				continue;
+			}
+
+			switch(SSL_get_error(ssl, result)) {
+				case SSL_ERROR_WANT_READ:
+					pfd[0].events |= POLLIN;
+					break;
+				case SSL_ERROR_WANT_WRITE:
+					pfd[0].events |= POLLOUT;
+					break;
+				default:
+					return;
+			}
+		}
+
+		/* From the other side to the application */
+
+		if(!outlen && !outeof) {
+			if((result = SSL_read(ssl, out, sizeof out)) > 0) {
+				outoff = 0;
+				outlen = result;
+			} else {
+				switch(SSL_get_error(ssl, result)) {
+					case SSL_ERROR_WANT_READ:
+						pfd[0].events |= POLLIN;
+						break;
+					case SSL_ERROR_WANT_WRITE:
+						pfd[0].events |= POLLOUT;
+						break;
+					case SSL_ERROR_ZERO_RETURN:
+						outeof = true;
+						shutdown(fd, SHUT_WR);
+						break;
+					default:
+						return;
+				}
+			}
+		}
+
+		if(outlen) {
+			if((result = write(fd, out + outoff, outlen)) > 0) {
+				outoff += result;
+				outlen -= result;
+				continue;
+			}
+
+			if(result == -1 && errno != EAGAIN && errno != EINTR)
+				return;
+
+			pfd[1].events |= POLLOUT;
+		}
+
+		if(ineof && outeof)
+			return;
+
+		if(poll(pfd, 2, -1) == -1 && errno != EINTR)
+			return;
+	}
+}
+
+/* Hand the connection to the kernel if it took both directions, otherwise
+   to a child process that does the encryption */
+
+static int tls_finish(SSL *ssl, int sock) {
+	int pair[2], null, fd;
+	pid_t pid;
+
+	if(BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl)))
+		return sock;
+
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair)) {
+		snprintf(error, sizeof error, "socketpair() failed: %s", strerror(errno));
+		return -1;
+	}
+
+	if((pid = fork()) == -1) {
+		snprintf(error, sizeof error, "fork() failed: %s", strerror(errno));
+		close(pair[0]);
+		close(pair[1]);
+		return -1;
+	}
+
+	if(pid) {
+		close(pair[1]);
+		return pair[0];
+	}
+
+	/* Don't keep the application's standard streams open */
+
+	close(pair[0]);
+	signal(SIGPIPE, SIG_IGN);
+
+	if((null = open("/dev/null", O_RDWR)) != -1)
+		for(fd = 0; fd < 3; fd++)
+			if(fd != sock && fd != pair[1])
+				dup2(null, fd);
+
+	relay(ssl, sock, pair[1]);
+	_exit(0);
+}
+
+/* The handshake itself is done on a blocking socket. OpenSSL writes the
+   messages of a flight one by one, which Nagle would hold up until the
+   other side's delayed ACK. */
+
+static int tls_start(SSL *ssl, int sock, bool server) {
+	int flags = fcntl(sock, F_GETFL), nodelay = 0, one = 1, result;
+	socklen_t len = sizeof nodelay;
+
+	fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
+	getsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, &len);
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+	if(!SSL_set_fd(ssl, sock)) {
+		tls_fail("Could not set up TLS");
+		return -1;
+	}
+
+	if((result = server ? SSL_accept(ssl) : SSL_connect(ssl)) != 1) {
+		if(SSL_get_verify_result(ssl) != X509_V_OK)
+			snprintf(error, sizeof error, "Could not verify certificate: %s", X509_verify_cert_error_string(SSL_get_verify_result(ssl)));
+		else
+			tls_fail("TLS handshake failed");
+		return -1;
+	}
+
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof nodelay);
+
+	if((result = tls_finish(ssl, sock)) == sock)
+		fcntl(sock, F_SETFL, flags);
+
+	return result;
+}
+
+int tls_client(int sock, const char *host, bool verbose) {
+	const char *cafile = getenv("RSH_CAFILE");
+	struct in6_addr addr;
+	SSL_CTX *ctx;
+	SSL *ssl = NULL;
+	int result = -1;
+
+	if(!(ctx = tls_context(TLS_client_method()))) {
+		tls_fail("Could not set up TLS");
+		return -1;
+	}
+
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+
+	if(!(cafile ? SSL_CTX_load_verify_locations(ctx, cafile, NULL) : SSL_CTX_set_default_verify_paths(ctx))) {
+		tls_fail("Could not load certificate authorities");
+		goto done;
+	}
+
+	if(!(ssl = SSL_new(ctx))) {
+		tls_fail("Could not set up TLS");
+		goto done;
+	}
+
+	/* The certificate has to be for the host we asked for */
+
+	if(inet_pton(AF_INET, host, &addr) == 1 || inet_pton(AF_INET6, host, &addr) == 1) {
+		X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host);
+	} else {
+		SSL_set_tlsext_host_name(ssl, host);
+		SSL_set1_host(ssl, host);
+	}
+
+	if((result = tls_start(ssl, sock, false)) != -1 && verbose)
+		fprintf(stderr, "%s with %s, encrypted %s\n", SSL_get_version(ssl), SSL_get_cipher(ssl), result == sock ? "by the kernel" : "in user space");
+
+done:
+	SSL_free(ssl);
+	SSL_CTX_free(ctx);
+	return result;
+}
+
+bool tls_server_init(const char *certfile) {
+	if(!(server = tls_context(TLS_server_method()))) {
+		tls_fail("Could not set up TLS");
+		return false;
+	}
+
+	if(!SSL_CTX_use_certificate_chain_file(server, certfile) || !SSL_CTX_use_PrivateKey_file(server, certfile, SSL_FILETYPE_PEM)) {
+		snprintf(error, sizeof error, "Could not load certificate from %s: %s", certfile, ERR_reason_error_string(ERR_get_error()));
+		ERR_clear_error();
+		SSL_CTX_free(server);
+		server = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+int tls_server(int sock) {
+	SSL *ssl;
+	int result;
+
+	if(!(ssl = SSL_new(server))) {
+		tls_fail("Could not set up TLS");
+		return -1;
+	}
+
+	result = tls_start(ssl, sock, true);
+	SSL_free(ssl);
+	return result;
+}
+
+bool tls_hello(int sock) {
+	unsigned char type;
+
+	/* A handshake record, a request starts with a digit or a NULL byte */
+
+	return recv(sock, &type, 1, MSG_PEEK) == 1 && type == 0x16;
+}
@@ -0,0 +1,52 @@
+/*
+    tls.h - encrypted connections, with the encryption done by the kernel
+    Copyright (C) 2026  agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef TLS_H
+#define TLS_H
+
+#include <stdbool.h>
+
+/* The handshake is done with OpenSSL, after which the kernel takes over
+   (kTLS), and the socket is used as if nothing happened, including with
+   sendfile() and splice(). If the kernel can't, a child process encrypts
+   in user space, and the connection continues over a socketpair to it.
+
+   Both return the file descriptor to use from now on, which is sock itself
+   if the kernel took over, or -1 if it failed, see tls_error(). The server
+   certificate is checked against $RSH_CAFILE if that is set, otherwise
+   against the system's certificate authorities.
+
+   The servers link with tls.c. The clients link with tlsclient.c instead,
+   whose tls_client() runs the handshake in the rsh-tls helper. */
+
+extern int tls_client(int sock, const char *host, bool verbose);
+extern int tls_server(int sock);
+
+/* Load the server's certificate, before tls_server() is used. A server
+   that listens by itself does this before it starts forking, so that the
+   connections don't each have to set up OpenSSL again. */
+
+extern bool tls_server_init(const char *certfile);
+
+/* Whether the client starts with a TLS handshake instead of a request */
+
+extern bool tls_hello(int sock);
+
+extern const char *tls_error(void);
+
+#endif
@@ -0,0 +1,128 @@
+/*
+    tlsclient.c - TLS for the clients, without linking them with OpenSSL
+    Copyright (C) 2026  agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <errno.h>
+#include <libgen.h>
+
+#include "tls.h"
+
+#ifndef LIBEXECDIR
+#define LIBEXECDIR "/usr/lib/rsh-redone"
+#endif
+
+static char error[256];
+
+const char *tls_error(void) {
+	return error;
+}
+
+/* Test builds use the helper that was built next to them */
+
+static const char *helper_path(void) {
+#ifdef TESTMODE
+	static char path[4096];
+	char self[4096];
+	int len;
+
+	if((len = readlink("/proc/self/exe", self, sizeof self - 1)) > 0) {
+		self[len] = 0;
+		snprintf(path, sizeof path, "%s/rsh-tls", dirname(self));
+		return path;
+	}
+#endif
+	return LIBEXECDIR "/rsh-tls";
+}
+
+/* Loading OpenSSL would double the time rsh takes to start, for every
+   command, so the handshake is done by the rsh-tls helper instead. It gets
+   the socket as its standard input, and a control socket as its standard
+   output, over which it passes back the file descriptor to use from now on,
+   or what went wrong. By then it has nothing left to do, and exits. */
+
+int tls_client(int sock, const char *host, bool verbose) {
+	const char *path = helper_path();
+	char *argv[5], **arg = argv;
+	char msg[sizeof error], control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = {msg, sizeof msg - 1};
+	struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof control};
+	struct cmsghdr *cmsg;
+	int ctl[2], fd = -1, status;
+	ssize_t len;
+	pid_t pid;
+
+	*arg++ = "rsh-tls";
+	if(verbose)
+		*arg++ = "-v";
+	*arg++ = "--";
+	*arg++ = (char *)host;
+	*arg = NULL;
+
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, ctl)) {
+		snprintf(error, sizeof error, "socketpair() failed: %s", strerror(errno));
+		return -1;
+	}
+
+	if((pid = fork()) == -1) {
+		snprintf(error, sizeof error, "fork() failed: %s", strerror(errno));
+		close(ctl[0]);
+		close(ctl[1]);
+		return -1;
+	}
+
+	if(!pid) {
+		dup2(sock, 0);
+		dup2(ctl[1], 1);
+		execv(path, argv);
+		dprintf(1, "Could not execute %s: %s", path, strerror(errno));
+		_exit(1);
+	}
+
+	close(ctl[1]);
+
+	while((len = recvmsg(ctl[0], &mh, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+
+	close(ctl[0]);
+	waitpid(pid, &status, 0);
+
+	for(cmsg = CMSG_FIRSTHDR(&mh); len >= 0 && cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg))
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(&fd, CMSG_DATA(cmsg), sizeof fd);
+
+	if(fd != -1) {
+		close(sock);
+		return fd;
+	}
+
+	if(len > 0) {
+		msg[len] = 0;
+		snprintf(error, sizeof error, "%s", msg);
+	} else {
+		snprintf(error, sizeof error, "TLS helper %s failed", path);
+	}
+
+	return -1;
+}
@@ -0,0 +1,75 @@
+/*
+    tlshelper.c - the TLS handshake for rsh and rlogin
+    Copyright (C) 2026  agent <agent@local>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License version 2 as published
+    by the Free Software Foundation.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <string.h>
+
+#include "tls.h"
+
+/* Started by tlsclient.c with the connection to the server on fd 0, and
+   the control socket on fd 1. Not meant to be run by hand. */
+
+static bool send_fd(int fd) {
+	char byte = 0, control[CMSG_SPACE(sizeof fd)];
+	struct iovec iov = {&byte, 1};
+	struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof control};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+
+	memset(control, 0, sizeof control);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof fd);
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof fd);
+
+	return sendmsg(1, &mh, MSG_NOSIGNAL) == 1;
+}
+
+int main(int argc, char **argv) {
+	bool verbose = false;
+	const char *error;
+	int opt, fd;
+
+	while((opt = getopt(argc, argv, "v")) != -1) {
+		switch(opt) {
+			case 'v':
+				verbose = true;
+				break;
+			default:
+				return 1;
+		}
+	}
+
+	if(optind != argc - 1) {
+		fprintf(stderr, "Usage: %s [-v] host\n", argv[0]);
+		return 1;
+	}
+
+	if((fd = tls_client(0, argv[optind], verbose)) == -1) {
+		error = tls_error();
+		send(1, error, strlen(error), MSG_NOSIGNAL);
+		return 1;
+	}
+
+	return !send_fd(fd);
+}